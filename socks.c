@@ -1,11 +1,30 @@
 /*** includes ***/
+// Feature test macros; these expose mmap() flags like MAP_ANONYMOUS and madvise()
+// which are not part of strict C99.
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 /*
@@ -14,18 +33,1035 @@ when pressed before a alphabet. It clears out the first three bits and returns t
 */
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+/*
+Size of a huge page on x86-64 and most arm64 kernels.
+Buffers at or above HUGE_PAGE_THRESHOLD are mapped aligned to this size so the kernel
+can back them with huge pages. One 2 MB TLB entry then covers what would otherwise
+need 512 entries of 4 KB pages, which matters when scanning multi-GB documents.
+*/
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define HUGE_PAGE_THRESHOLD (32UL * 1024 * 1024)
+
+// Number of lines one block of line metadata has room for. Must be a multiple of 64
+// so the dirty bitmap is made of whole words and every array in the block stays
+// aligned to a cache line.
+#define LINE_BLOCK_SIZE 512
+#define CACHE_LINE_SIZE 64
+// Children of a node of the line index tree, and the most levels of nodes it can have
+// (far more than the lines an int can count need).
+#define LINE_NODE_SIZE 64
+#define LINE_INDEX_HEIGHT 8
+
+// Number of columns a tab advances to.
+#define TAB_STOP 8
+
+// Lines looked at to find the timestamp format of a file, lines between two samples
+// of the time index, and lines looked ahead for a timestamp on lines without one.
+#define TIME_DETECT_LINES 64
+#define TIME_INDEX_STEP 4096
+#define TIME_SCAN_LINES 64
+
+// Most files in the merge view, and the bytes of a file between two samples of its
+// time index.
+#define MERGE_MAX_FILES 16
+#define MERGE_SAMPLE_BYTES (1024 * 1024)
+
+// Lines whose JSON view rows are cached, and the columns each level of the view is indented by.
+#define JSON_CACHE_LINES 1024
+#define JSON_INDENT 2
+
+// Number of lines whose render text and highlighting are kept in the render cache.
+#define RENDER_CACHE_LINES 4096
+
+// Lines longer than this are rendered a slice around the window at a time, and the
+// bytes between two column checkpoints of such a line.
+#define LONG_LINE_SIZE (64 * 1024)
+#define COLUMN_CHECKPOINT_BYTES 4096
+
+// Edited lines up to this many bytes are stored inside their row record.
+// Together with the two length fields this makes a row exactly two cache lines.
+#define ROW_INLINE_SIZE 120
+
+// Files are split into chunks of this size to find their lines in parallel.
+#define INDEX_CHUNK_SIZE (8UL * 1024 * 1024)
+
+// Searches split the file into chunks of about this size, one task each. Tasks check
+// for cancellation after every SEARCH_STEP_SIZE bytes.
+#define SEARCH_CHUNK_SIZE (4UL * 1024 * 1024)
+#define SEARCH_STEP_SIZE (64UL * 1024)
+
+// Number of edit records kept for observers that have not caught up yet.
+#define EDIT_LOG_SIZE 256
+// Most lines a search updates in place after edits; more and it starts over.
+#define SEARCH_RESCAN_LINES 64
+
+// Longest value counted by the statistics, and how far into a line its log level is looked for.
+#define STATS_KEY_SIZE 48
+#define STATS_LEVEL_BYTES 128
+
+// Columns of the minimap at the right edge of the text. Edits are counted in chunks
+// of at least MINIMAP_CHUNK_LINES lines, and at most MINIMAP_MAX_CHUNKS of them.
+#define MINIMAP_COLUMNS 2
+#define MINIMAP_CHUNK_LINES 256
+#define MINIMAP_MAX_CHUNKS 4096
+
+// Longest name of a mark, with its terminating zero.
+#define MARK_NAME_SIZE 16
+// Most positions kept in the jump list; the oldest ones are dropped.
+#define JUMP_LIST_SIZE 100
+
+// Session file written on exit, in the current directory unless SOCKS_SESSION names
+// another, and the bytes its contents start with.
+#define SESSION_FILE ".socks_session"
+#define SESSION_MAGIC "socks-s2"
+
+// Number of tasks each deque of the task pool can hold. Must be a power of two.
+#define TASK_DEQUE_CAPACITY 4096
+#define TASK_POOL_MAX_WORKERS 32
+
+// Maximum number of rows and columns of the information panel shown over the text.
+#define PANEL_ROWS 16
+#define PANEL_COLUMNS 80
+
+// Seconds a status message stays in the message bar.
+#define STATUS_MESSAGE_SECONDS 5
+
+#define ABUF_INIT {NULL, 0}
+
+// Most distinct cell attributes; cells with attributes past it get the default ones.
+#define ATTR_TABLE_SIZE 256
+
+// Slots of the table of multi code point clusters shown on screen, a power of two,
+// and the longest cluster it stores.
+#define GRAPHEME_TABLE_SIZE 4096
+#define GRAPHEME_MAX_BYTES 32
+// Set in a cell glyph that is an index in the grapheme table rather than a code point.
+#define CELL_GRAPHEME 0x80000000u
+
+// Keys that do not map to a single byte, numbered above the range of char.
+enum editorKey {
+  BACKSPACE = 127,
+  ARROW_LEFT = 1000,
+  ARROW_RIGHT,
+  ARROW_UP,
+  ARROW_DOWN,
+  DEL_KEY,
+  HOME_KEY,
+  END_KEY,
+  PAGE_UP,
+  PAGE_DOWN,
+  // Not a key; returned when background tasks have finished so the screen is redrawn.
+  TASK_DONE
+};
+
 /*** data ***/
 
+/*
+Subsystems that memory is accounted to. Every allocation the editor makes is
+charged to one of them, see the memory section.
+*/
+enum memCategory {
+  MEM_TEXT = 0,
+  MEM_LINE_INDEX,
+  MEM_EDIT_ROWS,
+  MEM_RENDER,
+  MEM_HIGHLIGHT,
+  MEM_SEARCH,
+  MEM_JSON,
+  MEM_TIME,
+  MEM_STATS,
+  MEM_MINIMAP,
+  MEM_MARKS,
+  MEM_PROMPT,
+  MEM_CATEGORIES
+};
+
+// Names of the memory categories, as shown by the memstats command.
+const char *memCategoryNames[MEM_CATEGORIES] = {
+  "text buffer",
+  "line index",
+  "edited rows",
+  "render cache",
+  "highlight",
+  "search results",
+  "json view",
+  "time index",
+  "statistics",
+  "minimap",
+  "marks",
+  "prompt"
+};
+
+// Kinds of highlighting, each drawn in its own color.
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_NUMBER,
+  HL_MATCH
+};
+
+// A block of memory holding the text of a document.
+struct textBuffer {
+  char *data;
+  // Number of bytes of text stored in data.
+  size_t size;
+  // Number of bytes reserved for data. Rounded up to HUGE_PAGE_SIZE when mapped.
+  size_t capacity;
+  // Set when data came from mmap() instead of malloc().
+  int mapped;
+};
+
+// A run of render text drawn with the same highlighting.
+struct highlightSpan {
+  size_t start;
+  size_t size;
+  enum editorHighlight hl;
+};
+
+// One grapheme cluster of a line that mixes directions, in display order.
+struct visualCluster {
+  // Bytes of the cluster in the render text.
+  uint32_t start;
+  uint32_t size;
+  // Column of the cluster in logical order, as the cursor counts columns.
+  int column;
+  int width;
+};
+
+// A cluster boundary of a long line and the screen column it starts at.
+struct columnCheckpoint {
+  size_t byte;
+  int column;
+};
+
+/*
+Checkpoints every COLUMN_CHECKPOINT_BYTES of a long line, so finding the text at a
+column, or the column of a byte, walks a few kilobytes at most. Built lazily, only as
+far into the line as has been looked at.
+*/
+struct columnIndex {
+  struct columnCheckpoint *points;
+  int count;
+  int capacity;
+  // Set once the checkpoints reach the end of the line.
+  int complete;
+};
+
+/*
+Text of a line as it is drawn on the screen, with tabs expanded to spaces, and the
+spans of it that are highlighted. chars holds size bytes followed by a terminating null.
+*/
+struct renderCache {
+  char *chars;
+  size_t size;
+  struct highlightSpan *spans;
+  int numSpans;
+  // Display order of the clusters, only for lines with right-to-left text. NULL
+  // means the line shows in logical order.
+  struct visualCluster *visual;
+  int numVisual;
+  // Screen columns held by chars: the whole line for most lines, a slice around the
+  // window for long ones, which also have a column index.
+  int sliceStart;
+  int sliceEnd;
+  struct columnIndex *columns;
+  // Position of the line in the eviction clock.
+  int clockSlot;
+  // Set when the line is drawn, cleared when the clock hand passes it.
+  int referenced;
+  // Different for every render ever built, so the layout can tell the line changed.
+  unsigned long stamp;
+};
+
+/*
+Lines that have a render cache, for the CLOCK eviction policy. The hand sweeps the
+slots looking for a line to evict, giving lines that were drawn since the last
+sweep a second chance. Lines within a screen of the window are never evicted, so
+the cache holds the working set around the viewport rather than every line ever shown.
+*/
+struct renderClock {
+  // Line cached in each slot, -1 for a free slot.
+  int *lines;
+  int capacity;
+  int hand;
+  // Edit records applied to the line numbers so far.
+  unsigned long seen;
+};
+
+// Grapheme_Cluster_Break property values, in the order of the Unicode table.
+enum graphemeBreak {
+  GCB_OTHER = 0,
+  GCB_CR,
+  GCB_LF,
+  GCB_CONTROL,
+  GCB_EXTEND,
+  GCB_ZWJ,
+  GCB_REGIONAL_INDICATOR,
+  GCB_PREPEND,
+  GCB_SPACINGMARK,
+  GCB_L,
+  GCB_V,
+  GCB_T,
+  GCB_LV,
+  GCB_LVT
+};
+
+// A cluster of more than one code point, as UTF-8. Empty slots have size 0.
+struct graphemeEntry {
+  unsigned char size;
+  char bytes[GRAPHEME_MAX_BYTES - 1];
+};
+
+/*
+Clusters of more than one code point (emoji sequences, letters with combining marks)
+shown on the screen, stored once each so a cell can refer to them by index. Open
+addressing on a hash of the bytes, allocated the first time it is needed.
+*/
+struct graphemeTable {
+  struct graphemeEntry *entries;
+  int count;
+};
+
+/*
+One character cell of the screen, packed in 8 bytes so a whole 400x120 screen is
+under 400 KB and two rows compare as plain memory. Colors are not stored in the cell
+but interned in the attribute table, and the cell keeps their index.
+*/
+struct cell {
+  // Unicode code point shown in the cell, or with CELL_GRAPHEME set, an index in the
+  // grapheme table.
+  uint32_t glyph;
+  // Index in the attribute table.
+  uint16_t attr;
+  // Columns the glyph takes on the screen. The column after a wide glyph holds a
+  // cell of width 0, so cells and columns keep the same indexes.
+  uint8_t width;
+  // Always 0, so equal cells are equal bytes.
+  uint8_t pad;
+};
+
+// Colors of a cell.
+struct cellAttr {
+  // ANSI foreground color code.
+  unsigned char fg;
+  // Set to swap foreground and background colors.
+  unsigned char inverse;
+  // Escape sequence that switches the terminal to these colors.
+  char sgr[16];
+  int sgrLen;
+};
+
+/*
+Every distinct combination of colors in use, stored once. Index 0 is the default
+colors. Only a handful of combinations ever exist, so interning is a short linear
+search.
+*/
+struct attrTable {
+  struct cellAttr attrs[ATTR_TABLE_SIZE];
+  int count;
+};
+
+// What a row of the screen shows.
+enum rowKind {
+  // Not laid out yet.
+  ROW_NONE = 0,
+  ROW_TEXT,
+  // Past the end of the file.
+  ROW_EMPTY,
+  ROW_PANEL,
+  ROW_MESSAGE,
+  // A row of the JSON view.
+  ROW_JSON,
+  // A row of the merge view.
+  ROW_MERGE
+};
+
+// Everything a row's cells are computed from. A row keeps its cells while its key
+// stays the same.
+struct rowKey {
+  enum rowKind kind;
+  int line;
+  int colOff;
+  // Stamp of the render text the row was laid out from.
+  unsigned long stamp;
+  // Minimap cells at the end of the row, see minimapRowKey().
+  int map;
+};
+
+struct gridRow {
+  struct cell *cells;
+  // Cells in use; the rest of the row is blank.
+  int length;
+  // Hash of the cells in use, so identical rows are skipped without comparing them.
+  uint64_t hash;
+  struct rowKey key;
+};
+
+/*
+The screen as a grid of cells. The layout stage fills one grid from the editor state,
+and the paint stage compares it with a second grid holding what the terminal shows,
+writing escape sequences only for the cells that differ.
+*/
+struct grid {
+  struct gridRow *rows;
+  int numRows;
+  int numColumns;
+  // Whether the terminal is known to show this grid; only used for the shown grid.
+  int valid;
+};
+
+// Text collected before being written to the terminal in one write().
+struct abuf {
+  char *b;
+  int len;
+};
+
+/*
+Text of a line that has been edited.
+Lines loaded from the file stay in the text buffer. Once a line is edited it gets a
+row of its own. Most lines are short, so rows keep up to ROW_INLINE_SIZE bytes
+inline (small string optimization) and only longer lines pay for a heap allocation
+and the extra pointer chase.
+*/
+typedef struct editRow {
+  uint32_t size;
+  // Bytes available for text. Rows with a capacity of ROW_INLINE_SIZE are inline.
+  uint32_t capacity;
+  union {
+    char inlined[ROW_INLINE_SIZE];
+    char *heap;
+  } chars;
+} editRow;
+
+/*
+Metadata for up to LINE_BLOCK_SIZE consecutive lines, stored as one array per field
+(structure of arrays) rather than as an array of per-line structs.
+A scan that needs one field, like a binary search over offsets, only pulls that
+field's cache lines into the cache instead of dragging every other field along.
+Blocks are allocated aligned to CACHE_LINE_SIZE.
+*/
+typedef struct lineBlock {
+  // Position of the start of each line in the text buffer.
+  size_t offset[LINE_BLOCK_SIZE];
+  // Length of each line, without the trailing newline.
+  size_t size[LINE_BLOCK_SIZE];
+  // Lazily built render text, NULL until the line is drawn.
+  struct renderCache *render[LINE_BLOCK_SIZE];
+  // Highlighter state at the end of each line, so highlighting can resume mid file.
+  unsigned char hlState[LINE_BLOCK_SIZE];
+  // One bit per line, set when the line differs from the file on disk.
+  // The text of a dirty line lives in rows instead of the text buffer.
+  uint64_t dirty[LINE_BLOCK_SIZE / 64];
+  // Edited rows, allocated the first time a line of the block is edited.
+  editRow *rows;
+  // Lines in the block, in slots [0, count).
+  int count;
+  // Snapshot epoch the block was created in. Snapshots taken in this epoch or later
+  // can see it, so it is copied before a write while one of them is alive.
+  unsigned long epoch;
+} lineBlock;
+
+/*
+The line under the cursor while it is being edited, held in a gap buffer.
+The text is split around a gap of unused bytes that sits at the edit position, so
+typing only fills the gap and deleting only widens it. Moving the gap costs the
+distance moved, which is zero for consecutive keystrokes, whatever the line length.
+The text goes back into the line index when the cursor leaves the line.
+*/
+struct gapBuffer {
+  // Line held in the buffer, or -1 when no line is active.
+  int line;
+  char *chars;
+  size_t capacity;
+  // Text is stored in [0, gapStart) and [gapEnd, capacity).
+  size_t gapStart;
+  size_t gapEnd;
+  // Copy of the text in one piece, for lineContiguous().
+  char *scratch;
+  size_t scratchCapacity;
+};
+
+// Text of a line as two contiguous pieces. The second piece is empty unless the
+// line is the active line, in which case the pieces are either side of the gap.
+struct lineText {
+  const char *chars[2];
+  size_t size[2];
+};
+
+/*
+Node of the line index tree. Its children are nodes one level down, or blocks in
+the nodes of the lowest level, each with the number of lines under it, so line at is
+found by walking down from the root and skipping the lines of the children before it
+(a counted B-tree).
+*/
+struct lineNode {
+  int lines[LINE_NODE_SIZE];
+  void *children[LINE_NODE_SIZE];
+  int count;
+  // Snapshot epoch the node was created in, like lineBlock.epoch.
+  unsigned long epoch;
+};
+
+/*
+Metadata of all the lines of a document: the root of a persistent tree of nodes
+over blocks of lines. Blocks split when they fill up and go when their last line
+does, so inserting or removing a line only shifts the lines of one block.
+A snapshot is a pointer to a root: once a root, node or block is shared, the editor
+copies it before writing to it, along with the nodes on the path down to it (path
+copying), so snapshots never change. Background readers can then work on a snapshot
+without locks, and without writing to any shared memory, while the main thread keeps
+editing.
+The render cache pointers and highlight state in the blocks belong to the main
+thread and are not part of what a snapshot sees.
+*/
+struct lineIndex {
+  struct lineNode *root;
+  // Levels of nodes, 1 when the children of the root are blocks.
+  int height;
+  int numLines;
+  // Snapshot epoch the root was created in, like lineBlock.epoch.
+  unsigned long epoch;
+};
+
+// The nodes and blocks on the way down to a line, and where the line is in its block.
+struct linePath {
+  struct lineNode *nodes[LINE_INDEX_HEIGHT];
+  int child[LINE_INDEX_HEIGHT];
+  lineBlock *block;
+  int slot;
+};
+
+/*
+The path to the block of the line the editor looked up last, and the number of the
+block's first line, so going through lines in order does not walk down the tree for
+every line. Writes keep it up to date with the copies they make, changes to the shape
+of the tree invalidate it.
+*/
+struct lineCache {
+  struct linePath path;
+  int first;
+  int valid;
+};
+
+/*
+An immutable view of the document for background readers.
+Roots, nodes and blocks are not reference counted. Every snapshot starts a new epoch,
+and anything the editor replaces is retired with the epoch of the newest snapshot that
+could see it. It is freed once no live snapshot is that old (epoch-based reclamation).
+Snapshots are taken and released on the main thread; readers only ever load.
+*/
+struct snapshot {
+  struct lineIndex *index;
+  unsigned long epoch;
+  // Buffer version when the snapshot was taken.
+  unsigned long version;
+};
+
+enum retiredKind {
+  RETIRED_ROOT,
+  RETIRED_NODE,
+  RETIRED_BLOCK
+};
+
+// A root, node or block replaced in the editor's index, waiting for older snapshots to go.
+struct retired {
+  void *ptr;
+  enum retiredKind kind;
+  // Newest snapshot epoch that may still see it.
+  unsigned long epoch;
+  struct retired *next;
+};
+
+/*
+One change to the document, for the observers that keep state about lines.
+The text removed and inserted starts at byte col of line. Lines after it move down by
+lineDelta: a positive delta splits the line, and a negative one joins the following
+-lineDelta lines onto it. Positions are line and column rather than text buffer
+offsets, since edited lines no longer live in the text buffer.
+*/
+struct editRecord {
+  // Buffer version the edit produced.
+  unsigned long version;
+  int line;
+  int col;
+  int removed;
+  int inserted;
+  int lineDelta;
+};
+
+/*
+Ring of the latest edit records. Each observer keeps the count of records it has
+applied and catches up when it next needs its state, so edits cost the same however
+many observers there are. An observer more than EDIT_LOG_SIZE records behind has
+lost track and rebuilds its state from scratch.
+*/
+struct editLog {
+  struct editRecord records[EDIT_LOG_SIZE];
+  // Number of records ever written; the next one goes in slot head % EDIT_LOG_SIZE.
+  unsigned long head;
+};
+
+/*
+Task queues ordered by priority. Workers take all viewport tasks they can find,
+in their own deque or by stealing, before they start on any background task.
+*/
+enum taskPriority {
+  TASK_VIEWPORT = 0,
+  TASK_BACKGROUND,
+  TASK_PRIORITIES
+};
+
+// Shared by a group of tasks so they can all be cancelled at once.
+struct cancelToken {
+  int cancelled;
+  // The submitter holds one reference and every queued task another.
+  int refs;
+  // The last reference may be dropped on a worker, so the token knows its own category.
+  enum memCategory category;
+};
+
+/*
+A unit of background work. Features embed this as the first member of their own
+task struct and cast back in the callbacks.
+  run      : Called on a worker thread. Skipped when the task is cancelled.
+  complete : Called on the main thread after run, from the event loop. Frees the task.
+*/
+struct task {
+  void (*run)(struct task *);
+  void (*complete)(struct task *);
+  struct cancelToken *token;
+  enum taskPriority priority;
+  // Link in the list of completed tasks.
+  struct task *next;
+};
+
+/*
+Chase-Lev work-stealing deque. The owning thread pushes and takes at the bottom
+without locks; other threads steal from the top with a compare and swap.
+top and bottom are on separate cache lines so thieves and the owner do not
+keep invalidating each other's line.
+*/
+struct taskDeque {
+  int64_t top __attribute__((aligned(CACHE_LINE_SIZE)));
+  int64_t bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+  struct task *buffer[TASK_DEQUE_CAPACITY] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/*
+Pool of worker threads shared by every feature that runs work in the background.
+Each worker, and the main thread, owns one deque per priority. Idle workers steal
+from the others. Finished tasks are pushed on a lock-free list and a byte is written
+to notifyPipe, which the event loop polls together with the keyboard.
+*/
+struct taskPool {
+  int numWorkers;
+  pthread_t workers[TASK_POOL_MAX_WORKERS];
+  // Deques of worker i are at i; the main thread owns the ones at numWorkers.
+  struct taskDeque (*deques)[TASK_PRIORITIES];
+  // Number of tasks waiting in the deques, workers sleep while it is 0.
+  int pending;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct task *completed;
+  int notifyPipe[2];
+};
+
+/*
+A search match, as a position in the line text. In a chunk the line counts from
+the first line of the chunk, so edits above a chunk only move its bounds.
+*/
+struct searchMatch {
+  int line;
+  int col;
+};
+
+// Matches found in a range of lines, [firstLine, endLine).
+struct searchChunk {
+  int firstLine;
+  int endLine;
+  struct searchMatch *matches;
+  int count;
+  // Set while a task searches the chunk, and when it has to be searched again.
+  int pending;
+  int stale;
+  // Set when the matches were given back to keep under the memory budget, the chunk
+  // is searched again when it comes near the screen.
+  int dropped;
+};
+
+/*
+A search of the document. The lines are split into chunks of about SEARCH_CHUNK_SIZE
+bytes that are searched by background tasks, in passes over snapshots of the
+document, while the user keeps typing. Edits made during a pass are applied to the
+results of its tasks when they come back, so typing never restarts the search.
+*/
+struct searchJob {
+  char *pattern;
+  size_t patternLen;
+  // Snapshot of the pass running, and the edit log head when it was taken.
+  struct snapshot *snapshot;
+  unsigned long passHead;
+  struct cancelToken *token;
+  struct searchChunk *chunks;
+  int numChunks;
+  // Fenwick tree of the number of matches in each chunk.
+  long *counts;
+  // Chunks still being searched.
+  int remaining;
+  // Edit records applied to the matches so far.
+  unsigned long seen;
+  // The editor holds one reference and every queued task another.
+  int refs;
+};
+
+// A row of the JSON view: bytes [start, end) of a line, indented depth levels.
+struct jsonRow {
+  size_t start;
+  size_t end;
+  int depth;
+};
+
+// A scan of JSON text for its structural characters, one block of 16 bytes at a time.
+struct jsonScan {
+  const char *s;
+  size_t len;
+  size_t pos;
+  int inString;
+  int escaped;
+  // Offsets of the structural characters of the last block.
+  size_t found[16];
+  int count;
+};
+
+// View rows of a line, line is -1 for a free cache slot.
+struct jsonLayout {
+  int line;
+  struct jsonRow *rows;
+  int numRows;
+};
+
+/*
+Pretty printed view of lines holding JSON, one value per line as in NDJSON logs.
+The text is not changed: each view row is a range of a line shown indented, so a
+position in the view is also a position in the file. Rows are only computed for the
+lines shown, and kept in a direct mapped cache.
+*/
+struct jsonView {
+  int enabled;
+  struct jsonLayout cache[JSON_CACHE_LINES];
+  // First row shown and the cursor row, each as a line and a view row of that line.
+  int topLine, topRow;
+  int cursorLine, cursorRow;
+  int cursorScreenRow;
+  // Changed whenever the cached rows are dropped, for the layout.
+  unsigned long stamp;
+};
+
+// Timestamp formats found at the start of log lines.
+enum timeFormat {
+  TIME_NONE = 0,
+  // 2024-01-31T14:32:05, also with a space in place of the T.
+  TIME_ISO,
+  // Jan 31 14:32:05, as written by syslog.
+  TIME_SYSLOG,
+  // 14:32:05, a time of day alone.
+  TIME_CLOCK
+};
+
+// The timestamp of a line, in seconds.
+struct timeSample {
+  long long time;
+  int line;
+};
+
+/*
+Sparse index of the timestamps of a log: one sample every TIME_INDEX_STEP lines, so
+finding a time is a binary search over the samples and then over the lines between
+two of them. Built on first use, and again after the text changed.
+*/
+struct timeIndex {
+  enum timeFormat format;
+  struct timeSample *samples;
+  int count;
+  // Buffer version the index was built for.
+  unsigned long version;
+};
+
+// A file of the merge view, mapped read only.
+struct mergeSource {
+  const char *name;
+  const char *data;
+  size_t size;
+  enum timeFormat format;
+  // Timestamp of the first entry of each MERGE_SAMPLE_BYTES block, LLONG_MIN until read.
+  long long *samples;
+  // Timestamp the lines above each block sort by, LLONG_MAX until found.
+  long long *keys;
+  size_t numSamples;
+};
+
+// A position in the merge view: the offset of the next line of each file, and the
+// timestamps that line and the one before it sort by, kept up to date as it moves.
+struct mergePosition {
+  size_t offsets[MERGE_MAX_FILES];
+  long long keys[MERGE_MAX_FILES];
+  long long before[MERGE_MAX_FILES];
+};
+
+/*
+Several logs shown as one, ordered by timestamp, like rotated logs or the logs of
+several hosts. Nothing is merged ahead of time: the rows of the window are merged
+from the files when they are drawn, and a time is found in every file separately.
+*/
+struct mergeView {
+  int enabled;
+  struct mergeSource sources[MERGE_MAX_FILES];
+  int numSources;
+  struct mergePosition top;
+  struct mergePosition cursor;
+  int cursorScreenRow;
+};
+
+// A value and the number of lines it was found on. Free slots have a count of 0.
+struct statsEntry {
+  char key[STATS_KEY_SIZE];
+  unsigned char size;
+  long count;
+};
+
+// Counts per value, open addressing over a power of two number of slots.
+struct statsMap {
+  struct statsEntry *entries;
+  int capacity;
+  int count;
+};
+
+// Counts of a range of lines, [firstLine, endLine). Dirty chunks are counted again.
+struct statsChunk {
+  int firstLine;
+  int endLine;
+  struct statsMap map;
+  int dirty;
+};
+
+/*
+Counts of the lines of the file by log level, or by the values of a field. Every
+chunk of lines has its own counts, so an edit only has the chunks it touched
+counted again. Passes over the dirty chunks run in the background, like searches.
+*/
+struct statsJob {
+  // Field whose values are counted, NULL for log levels.
+  char *field;
+  struct statsChunk *chunks;
+  int numChunks;
+  // Snapshot of the pass running, and its chunks still being counted.
+  struct snapshot *snapshot;
+  int remaining;
+  struct cancelToken *token;
+  // Edit records applied to the chunks so far.
+  unsigned long seen;
+  // Set when the counts are to be shown once the running pass is done.
+  int show;
+  // The editor holds one reference and every queued task another.
+  int refs;
+};
+
+/*
+Density of search matches and edits over the whole file, drawn at the right edge.
+Edits are counted per chunk of lines. The line counts and edit counts of the chunks
+are both kept in Fenwick trees, so an edit record moves the chunk bounds and counts
+itself in O(log chunks), and each row of the minimap costs O(log chunks) to draw
+however big the file is.
+*/
+struct minimap {
+  int enabled;
+  int numChunks;
+  long *lines;
+  long *edits;
+  // Edit records counted so far.
+  unsigned long seen;
+  // Matches and edits of each row of the window while it is laid out, and the most of any row.
+  long *rowMatches;
+  long *rowEdits;
+  long maxMatches;
+  long maxEdits;
+};
+
+/*
+A mark in the treap of marks. Positions are line << 32 | column, so they order like
+text positions and moving a mark by lines is one addition.
+*/
+struct markNode {
+  // Position, less the shifts of its ancestors that were not pushed down yet.
+  int64_t pos;
+  // Shift of every position below the node, not yet applied to its children.
+  int64_t shift;
+  // Heap priority of the treap; 0 for a free node.
+  uint32_t priority;
+  // Children and parent, as indexes in the node array; 0 is no node.
+  int left;
+  int right;
+  int parent;
+  // Empty for marks that have no name.
+  char name[MARK_NAME_SIZE];
+};
+
+/*
+Marks ordered by position, in a treap with lazy shifts. An edit that moves lines
+splits off the marks below it and shifts them all with one addition at the root of
+their subtree, so an edit record costs O(log n) however many marks there are. Only
+the marks on the edited lines themselves are moved one by one.
+Nodes live in one array and link by index, with free ones chained through left.
+*/
+struct markTree {
+  struct markNode *nodes;
+  int capacity;
+  int root;
+  int freeList;
+  int count;
+  uint32_t seed;
+  // Edit records applied so far.
+  unsigned long seen;
+};
+
+/*
+Positions the cursor jumped from, oldest first, for going back and forth like in a
+browser. Positions are unnamed marks, so edits keep them on their text.
+*/
+struct jumpList {
+  // Nodes of the marks.
+  int anchors[JUMP_LIST_SIZE];
+  int count;
+  // Entry the cursor was last sent to; count when it is past the newest one.
+  int current;
+};
+
+/*
+Start of a session file. It is followed by numFiles sessionFile entries, each
+with the bytes of its name, then numMarks sessionMark entries, the numJumps
+positions of the jump list and the patternSize bytes of the search pattern.
+*/
+struct sessionHeader {
+  char magic[8];
+  int32_t numFiles;
+  int32_t cx, cy;
+  int32_t rowOff, colOff;
+  int32_t minimap;
+  int32_t numMarks;
+  int32_t numJumps;
+  int32_t jumpCurrent;
+  int32_t patternSize;
+};
+
+/*
+A file of a session, and what it looked like when the session was saved. For the
+file that was open, numLines and modified describe the text the positions of the
+session are in: edits are not written back, so with modified set they are in text
+the file does not have.
+*/
+struct sessionFile {
+  uint64_t size;
+  int64_t mtime;
+  uint64_t inode;
+  int32_t numLines;
+  int32_t modified;
+  uint32_t nameSize;
+};
+
+struct sessionMark {
+  int64_t pos;
+  char name[MARK_NAME_SIZE];
+};
+
 // Struct to store editor related information.
 struct editorConfig {
+  // Cursor position; cx is an index into the line text, cy the line number.
+  int cx, cy;
+  // Cursor column on the screen, after tabs are expanded.
+  int rx;
+  // First line and first column shown on the screen.
+  int rowOff;
+  int colOff;
   int screenRows;
   int screenColumns;
+  // Columns of the screen the text is shown in, the rest is the minimap.
+  int textColumns;
+  // Text of the open file.
+  struct textBuffer text;
+  // Lines of the open file. Owned by the editor, snapshots share parts of it.
+  struct lineIndex *index;
+  struct lineCache lineCache;
+  // Current snapshot epoch, one past the epoch of the newest snapshot.
+  unsigned long epoch;
+  // Live snapshots, oldest first, and what was retired while they were alive.
+  struct snapshot **snapshots;
+  int numSnapshots;
+  int snapshotCapacity;
+  struct retired *retired;
+  // Line being edited.
+  struct gapBuffer active;
+  struct renderClock clock;
+  // Last stamp given to a render.
+  unsigned long renderStamp;
+  // The next frame, and what the terminal currently shows.
+  struct grid layout;
+  struct grid shown;
+  struct attrTable attrs;
+  struct graphemeTable graphemes;
+  // Bytes currently allocated by each subsystem.
+  size_t memUsed[MEM_CATEGORIES];
+  // Largest total ever allocated.
+  size_t memPeak;
+  // Total the editor tries to stay under by evicting caches; 0 means no limit.
+  size_t memBudget;
+  // Message shown in the message bar at the bottom, and when it was set.
+  char statusMessage[PANEL_COLUMNS];
+  time_t statusMessageTime;
+  // Lines of the information panel drawn over the bottom of the text, hidden on the next key.
+  char panel[PANEL_ROWS][PANEL_COLUMNS];
+  int panelRows;
+  struct taskPool pool;
+  // Incremented by every edit; background results for an older version are stale.
+  unsigned long version;
+  struct editLog edits;
+  // Search whose matches are highlighted, NULL when there is none.
+  struct searchJob *search;
+  struct jsonView json;
+  struct timeIndex times;
+  struct mergeView merge;
+  // Counts shown by the stats command, NULL when there are none.
+  struct statsJob *stats;
+  struct minimap minimap;
+  struct markTree marks;
+  struct jumpList jumps;
+  // Files given on the command line, the first one is edited.
+  char **fileNames;
+  int numFiles;
   // This variable stored the termios state at program init.
   struct termios original_termios;
 };
 
 struct editorConfig E;
 
+// Index of the deques owned by the running thread.
+__thread int taskSelf;
+
+/*** prototypes ***/
+
+void taskPoolDrain();
+void editorFlushActiveLine();
+int editorLineCxToRx(int at, int cx);
+struct renderCache *lineRender(int at);
+const char *lineContiguous(int at, size_t *size);
+void editorSetStatusMessage(const char *fmt, ...);
+void editorPanelAdd(const char *fmt, ...);
+void jumpPush(int line, int col);
+void searchPass(struct searchJob *job);
+void searchObserve();
+void jsonViewShrink();
+void sessionSave();
+int searchLineMatches(int at, struct searchMatch **matches);
+long long mergeBlockKey(struct mergeSource *src, size_t block);
+
 /*** terminal ***/
 
 // Method to handle errors during program execution.
@@ -104,10 +1140,10 @@ void enableRawMode()
 }
 
 /*
-Reads one character at a time from the terminal and returns it to the calling method.
-TODO : Expand to handle escape sequences.
+Reads one key from the terminal and returns it to the calling method.
+Escape sequences sent by arrow and navigation keys are decoded to editorKey values.
 */
-char editorReadKey(){
+int editorReadKey(){
   // Number of characters read.
   int nread;
   // Initialize with an empty chaacter.
@@ -117,13 +1153,76 @@ char editorReadKey(){
     our case is the console. It returns the number of characters entered and returns
     0 when EOF is reached. Here we are checking till the point a character is entered.
   */
-  while((nread = read(STDIN_FILENO, &c, 1)) != 1)
+  /*
+    poll() waits for either a key press or a finished background task. Finished
+    tasks are handed back to the caller as the TASK_DONE key so the screen gets
+    redrawn with their results.
+  */
+  struct pollfd fds[2] = {
+    {STDIN_FILENO, POLLIN, 0},
+    {E.pool.notifyPipe[0], POLLIN, 0}
+  };
+  while (1)
   {
-    if (nread == -1 && errno != EAGAIN) {
-      die("editorReadKey - read()");
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("editorReadKey - poll()");
+    }
+    if (fds[1].revents & POLLIN) {
+      taskPoolDrain();
+      return TASK_DONE;
+    }
+    if (fds[0].revents & POLLIN) {
+      nread = read(STDIN_FILENO, &c, 1);
+      if (nread == 1) break;
+      if (nread == -1 && errno != EAGAIN) {
+        die("editorReadKey - read()");
+      }
+    }
+  }
+
+  if (c != '\x1b') return (unsigned char)c;
+
+  /*
+    Navigation keys send <esc>[ followed by a letter, or by a number and ~.
+    Some terminals send <esc>O instead for Home and End. If the rest of the
+    sequence does not arrive within the read timeout, it was a plain Escape.
+  */
+  char seq[3];
+  if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
+  if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+
+  if (seq[0] == '[') {
+    if (seq[1] >= '0' && seq[1] <= '9') {
+      if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+      if (seq[2] == '~') {
+        switch (seq[1]) {
+          case '1': return HOME_KEY;
+          case '3': return DEL_KEY;
+          case '4': return END_KEY;
+          case '5': return PAGE_UP;
+          case '6': return PAGE_DOWN;
+          case '7': return HOME_KEY;
+          case '8': return END_KEY;
+        }
+      }
+    } else {
+      switch (seq[1]) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+      }
+    }
+  } else if (seq[0] == 'O') {
+    switch (seq[1]) {
+      case 'H': return HOME_KEY;
+      case 'F': return END_KEY;
     }
   }
-  return c;
+  return '\x1b';
 }
 
 /*
@@ -142,60 +1241,5570 @@ int getWindowSize(int *rows, int *columns){
   }
 }
 
-/*** output ***/
+/*** memory ***/
 
 /*
-Method to put a TILDE ~ sign at the bneginning of each line in th eeditor space.
-This is very close to how vim works.
-Once we start reading contents from files, the TILDEs should come only after the
-end of line is encountered.
-This means that column 0 of each row is unavailable for editing.
+Allocation wrappers that charge every allocation to a memory category.
+Callers pass the size back when freeing; the editor always knows how large its
+buffers are, so there is no need to ask the allocator.
+Running out of memory is not recoverable, so these never return NULL.
 */
-void editorDrawRows(){
-  unsigned short int windowSize = E.screenRows;
-  for (unsigned short i = 0; i < windowSize; i++) {
-    write(STDOUT_FILENO, "~\r\n", 3);
-  }
+
+// Total number of bytes allocated by the editor.
+size_t memTotal(){
+  size_t total = 0;
+  for (int i = 0; i < MEM_CATEGORIES; i++) total += __atomic_load_n(&E.memUsed[i], __ATOMIC_RELAXED);
+  return total;
 }
-/*
-Method clears out the area in the terminal to be used as the editor area.
-  write : Writes to the output buffer.
-  STDOUT_FILENO : Standard output. In our case th terminal.
-  \x1b : Escape character.
-  [ : Used after the escape character to specify the command to be executed.
-  2 : Parameter to J which says clean the whole page.
-  J : Erase in display [http://vt100.net/docs/vt100-ug/chapter3.html#ED]
-  H : Positions the cursor on the screen; takes two parameters that are X and Y separated by ; like <esc>[12;40H
-  4 : Number of bytes being written to output.
-*/
-void editorRefreshScreen(){
-  // Clears out the screen.
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  // Repositions the cursor at start of screen.
-  write(STDOUT_FILENO, "\x1b[H", 3);
-  // SHow tildes on the screen.
-  editorDrawRows();
-  // Repositions the cursor at start of screen.
-  write(STDOUT_FILENO, "\x1b[H", 3);
+
+// Background tasks allocate too, so the counters are only updated atomically.
+void memAccount(enum memCategory category, size_t allocated, size_t freed){
+  __atomic_add_fetch(&E.memUsed[category], allocated - freed, __ATOMIC_RELAXED);
+  size_t total = memTotal();
+  size_t peak = __atomic_load_n(&E.memPeak, __ATOMIC_RELAXED);
+  while (total > peak &&
+         !__atomic_compare_exchange_n(&E.memPeak, &peak, total, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-/*** input ***/
+void *memAlloc(enum memCategory category, size_t size){
+  void *ptr = malloc(size ? size : 1);
+  if (ptr == NULL) die("memAlloc - malloc");
+  memAccount(category, size, 0);
+  return ptr;
+}
 
-/*
-Reads the key from the terminal and exits the program if the key is Ctrl Q.
-TODO : Handle other editor related key commands.
-*/
-void editorProcessKey(){
-  char c = editorReadKey();
-  switch (c){
-    case CTRL_KEY('q'):
+void *memCalloc(enum memCategory category, size_t count, size_t size){
+  void *ptr = calloc(count ? count : 1, size ? size : 1);
+  if (ptr == NULL) die("memCalloc - calloc");
+  memAccount(category, count * size, 0);
+  return ptr;
+}
+
+void *memRealloc(enum memCategory category, void *ptr, size_t oldSize, size_t newSize){
+  ptr = realloc(ptr, newSize ? newSize : 1);
+  if (ptr == NULL) die("memRealloc - realloc");
+  memAccount(category, newSize, oldSize);
+  return ptr;
+}
+
+void memFree(enum memCategory category, void *ptr, size_t size){
+  if (ptr == NULL) return;
+  free(ptr);
+  memAccount(category, 0, size);
+}
+
+// Writes a byte count with a binary unit suffix, like 12.5 MB.
+void memFormat(char *buf, size_t bufsize, size_t bytes){
+  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double value = bytes;
+  int unit = 0;
+  while (value >= 1024 && unit < 4) {
+    value /= 1024;
+    unit++;
+  }
+  if (unit == 0) {
+    snprintf(buf, bufsize, "%zu B", bytes);
+  } else {
+    snprintf(buf, bufsize, "%.1f %s", value, units[unit]);
+  }
+}
+
+/*
+Allocates a buffer that can hold size bytes of document text.
+Small buffers come from malloc(). Large ones are mapped directly with mmap() so that
+they can be backed by huge pages:
+  - First we ask for explicit 2 MB pages with MAP_HUGETLB. This only works when the
+    administrator reserved huge pages (vm.nr_hugepages), so it usually fails.
+  - Otherwise we map a regular anonymous region aligned to HUGE_PAGE_SIZE and ask
+    for transparent huge pages with madvise(MADV_HUGEPAGE). The alignment matters,
+    the kernel can only use a huge page for a fully covered aligned 2 MB range.
+*/
+void textBufferAlloc(struct textBuffer *buf, size_t size){
+  buf->size = 0;
+  buf->mapped = 0;
+  if (size < HUGE_PAGE_THRESHOLD) {
+    buf->capacity = size;
+    buf->data = memAlloc(MEM_TEXT, size);
+    return;
+  }
+
+  size_t capacity = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  buf->capacity = capacity;
+  buf->mapped = 1;
+  memAccount(MEM_TEXT, capacity, 0);
+
+#ifdef MAP_HUGETLB
+  buf->data = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (buf->data != MAP_FAILED) return;
+#endif
+
+  // Map one extra huge page so an aligned start can be picked inside the region,
+  // then hand the unused head and tail back to the kernel.
+  size_t span = capacity + HUGE_PAGE_SIZE;
+  char *region = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) die("textBufferAlloc - mmap");
+  char *aligned = (char *)(((size_t)region + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  size_t head = aligned - region;
+  if (head) munmap(region, head);
+  size_t tail = span - head - capacity;
+  if (tail) munmap(aligned + capacity, tail);
+  buf->data = aligned;
+
+#ifdef MADV_HUGEPAGE
+  // Failure is not fatal, we only lose the TLB benefit.
+  madvise(buf->data, capacity, MADV_HUGEPAGE);
+#endif
+}
+
+// Releases the memory held by a text buffer.
+void textBufferFree(struct textBuffer *buf){
+  if (buf->data == NULL) return;
+  if (buf->mapped) {
+    munmap(buf->data, buf->capacity);
+    memAccount(MEM_TEXT, 0, buf->capacity);
+  } else {
+    memFree(MEM_TEXT, buf->data, buf->capacity);
+  }
+  buf->data = NULL;
+  buf->size = buf->capacity = 0;
+}
+
+/*** unicode ***/
+
+/*
+Unicode properties of every code point, as a sorted list of runs. Each entry holds
+the first code point of a run in its upper 24 bits and the properties shared by the
+run in its low 8 bits:
+  bits 0-3 : Grapheme_Cluster_Break value, see enum graphemeBreak.
+  bit 4    : Extended_Pictographic.
+  bits 5-6 : Columns taken on the screen, 0, 1 or 2.
+Generated from the Unicode 16.0 GraphemeBreakProperty and emoji-data files, and
+East_Asian_Width for the wide characters. Hangul syllables are one run here, their
+LV and LVT values follow a formula and are computed in unicodeProps().
+*/
+static const uint32_t unicodeTable[] = {
+  0x00000023, 0x00000a22, 0x00000b23, 0x00000d21, 0x00000e23, 0x00002020, 0x00007f23,
+  0x0000a020, 0x0000a930, 0x0000aa20, 0x0000ad23, 0x0000ae30, 0x0000af20, 0x00030004,
+  0x00037020, 0x00048304, 0x00048a20, 0x00059104, 0x0005be20, 0x0005bf04, 0x0005c020,
+  0x0005c104, 0x0005c320, 0x0005c404, 0x0005c620, 0x0005c704, 0x0005c820, 0x00060007,
+  0x00060620, 0x00061004, 0x00061b20, 0x00061c03, 0x00061d20, 0x00064b04, 0x00066020,
+  0x00067004, 0x00067120, 0x0006d604, 0x0006dd07, 0x0006de20, 0x0006df04, 0x0006e520,
+  0x0006e704, 0x0006e920, 0x0006ea04, 0x0006ee20, 0x00070f07, 0x00071020, 0x00071104,
+  0x00071220, 0x00073004, 0x00074b20, 0x0007a604, 0x0007b120, 0x0007eb04, 0x0007f420,
+  0x0007fd04, 0x0007fe20, 0x00081604, 0x00081a20, 0x00081b04, 0x00082420, 0x00082504,
+  0x00082820, 0x00082904, 0x00082e20, 0x00085904, 0x00085c20, 0x00089007, 0x00089220,
+  0x00089704, 0x0008a020, 0x0008ca04, 0x0008e207, 0x0008e304, 0x00090308, 0x00090420,
+  0x00093a04, 0x00093b08, 0x00093c04, 0x00093d20, 0x00093e08, 0x00094104, 0x00094908,
+  0x00094d04, 0x00094e08, 0x00095020, 0x00095104, 0x00095820, 0x00096204, 0x00096420,
+  0x00098104, 0x00098208, 0x00098420, 0x0009bc04, 0x0009bd20, 0x0009be04, 0x0009bf08,
+  0x0009c104, 0x0009c520, 0x0009c708, 0x0009c920, 0x0009cb08, 0x0009cd04, 0x0009ce20,
+  0x0009d704, 0x0009d820, 0x0009e204, 0x0009e420, 0x0009fe04, 0x0009ff20, 0x000a0104,
+  0x000a0308, 0x000a0420, 0x000a3c04, 0x000a3d20, 0x000a3e08, 0x000a4104, 0x000a4320,
+  0x000a4704, 0x000a4920, 0x000a4b04, 0x000a4e20, 0x000a5104, 0x000a5220, 0x000a7004,
+  0x000a7220, 0x000a7504, 0x000a7620, 0x000a8104, 0x000a8308, 0x000a8420, 0x000abc04,
+  0x000abd20, 0x000abe08, 0x000ac104, 0x000ac620, 0x000ac704, 0x000ac908, 0x000aca20,
+  0x000acb08, 0x000acd04, 0x000ace20, 0x000ae204, 0x000ae420, 0x000afa04, 0x000b0020,
+  0x000b0104, 0x000b0208, 0x000b0420, 0x000b3c04, 0x000b3d20, 0x000b3e04, 0x000b4008,
+  0x000b4104, 0x000b4520, 0x000b4708, 0x000b4920, 0x000b4b08, 0x000b4d04, 0x000b4e20,
+  0x000b5504, 0x000b5820, 0x000b6204, 0x000b6420, 0x000b8204, 0x000b8320, 0x000bbe04,
+  0x000bbf08, 0x000bc004, 0x000bc108, 0x000bc320, 0x000bc608, 0x000bc920, 0x000bca08,
+  0x000bcd04, 0x000bce20, 0x000bd704, 0x000bd820, 0x000c0004, 0x000c0108, 0x000c0404,
+  0x000c0520, 0x000c3c04, 0x000c3d20, 0x000c3e04, 0x000c4108, 0x000c4520, 0x000c4604,
+  0x000c4920, 0x000c4a04, 0x000c4e20, 0x000c5504, 0x000c5720, 0x000c6204, 0x000c6420,
+  0x000c8104, 0x000c8208, 0x000c8420, 0x000cbc04, 0x000cbd20, 0x000cbe08, 0x000cbf04,
+  0x000cc108, 0x000cc204, 0x000cc308, 0x000cc520, 0x000cc604, 0x000cc920, 0x000cca04,
+  0x000cce20, 0x000cd504, 0x000cd720, 0x000ce204, 0x000ce420, 0x000cf308, 0x000cf420,
+  0x000d0004, 0x000d0208, 0x000d0420, 0x000d3b04, 0x000d3d20, 0x000d3e04, 0x000d3f08,
+  0x000d4104, 0x000d4520, 0x000d4608, 0x000d4920, 0x000d4a08, 0x000d4d04, 0x000d4e27,
+  0x000d4f20, 0x000d5704, 0x000d5820, 0x000d6204, 0x000d6420, 0x000d8104, 0x000d8208,
+  0x000d8420, 0x000dca04, 0x000dcb20, 0x000dcf04, 0x000dd008, 0x000dd204, 0x000dd520,
+  0x000dd604, 0x000dd720, 0x000dd808, 0x000ddf04, 0x000de020, 0x000df208, 0x000df420,
+  0x000e3104, 0x000e3220, 0x000e3328, 0x000e3404, 0x000e3b20, 0x000e4704, 0x000e4f20,
+  0x000eb104, 0x000eb220, 0x000eb328, 0x000eb404, 0x000ebd20, 0x000ec804, 0x000ecf20,
+  0x000f1804, 0x000f1a20, 0x000f3504, 0x000f3620, 0x000f3704, 0x000f3820, 0x000f3904,
+  0x000f3a20, 0x000f3e08, 0x000f4020, 0x000f7104, 0x000f7f08, 0x000f8004, 0x000f8520,
+  0x000f8604, 0x000f8820, 0x000f8d04, 0x000f9820, 0x000f9904, 0x000fbd20, 0x000fc604,
+  0x000fc720, 0x00102b00, 0x00102d04, 0x00103108, 0x00103204, 0x00103800, 0x00103904,
+  0x00103b08, 0x00103d04, 0x00103f20, 0x00105608, 0x00105804, 0x00105a20, 0x00105e04,
+  0x00106120, 0x00106200, 0x00106520, 0x00106700, 0x00106e20, 0x00107104, 0x00107520,
+  0x00108204, 0x00108300, 0x00108408, 0x00108504, 0x00108700, 0x00108d04, 0x00108e20,
+  0x00108f00, 0x00109020, 0x00109a00, 0x00109d04, 0x00109e20, 0x00110049, 0x0011600a,
+  0x0011a80b, 0x00120020, 0x00135d04, 0x00136020, 0x00171204, 0x00171620, 0x00173204,
+  0x00173520, 0x00175204, 0x00175420, 0x00177204, 0x00177420, 0x0017b404, 0x0017b608,
+  0x0017b704, 0x0017be08, 0x0017c604, 0x0017c708, 0x0017c904, 0x0017d420, 0x0017dd04,
+  0x0017de20, 0x00180b04, 0x00180e03, 0x00180f04, 0x00181020, 0x00188504, 0x00188720,
+  0x0018a904, 0x0018aa20, 0x00192004, 0x00192308, 0x00192704, 0x00192908, 0x00192c20,
+  0x00193008, 0x00193204, 0x00193308, 0x00193904, 0x00193c20, 0x001a1704, 0x001a1908,
+  0x001a1b04, 0x001a1c20, 0x001a5508, 0x001a5604, 0x001a5708, 0x001a5804, 0x001a5f20,
+  0x001a6004, 0x001a6100, 0x001a6204, 0x001a6300, 0x001a6504, 0x001a6d08, 0x001a7304,
+  0x001a7d20, 0x001a7f04, 0x001a8020, 0x001ab004, 0x001acf00, 0x001ade20, 0x001ae000,
+  0x001aec20, 0x001b0004, 0x001b0408, 0x001b0520, 0x001b3404, 0x001b3e08, 0x001b4204,
+  0x001b4520, 0x001b6b04, 0x001b7420, 0x001b8004, 0x001b8208, 0x001b8320, 0x001ba108,
+  0x001ba204, 0x001ba608, 0x001ba804, 0x001bae20, 0x001be604, 0x001be708, 0x001be804,
+  0x001bea08, 0x001bed04, 0x001bee08, 0x001bef04, 0x001bf420, 0x001c2408, 0x001c2c04,
+  0x001c3408, 0x001c3604, 0x001c3820, 0x001cd004, 0x001cd320, 0x001cd404, 0x001ce108,
+  0x001ce204, 0x001ce920, 0x001ced04, 0x001cee20, 0x001cf404, 0x001cf520, 0x001cf708,
+  0x001cf804, 0x001cfa20, 0x001dc004, 0x001e0020, 0x00200b03, 0x00200c04, 0x00200d05,
+  0x00200e03, 0x00201020, 0x00202803, 0x00202f20, 0x00203c30, 0x00203d20, 0x00204930,
+  0x00204a20, 0x00206003, 0x00206523, 0x00206603, 0x00207020, 0x0020d004, 0x0020f120,
+  0x00212230, 0x00212320, 0x00213930, 0x00213a20, 0x00219430, 0x00219a20, 0x0021a930,
+  0x0021ab20, 0x00231a50, 0x00231c20, 0x00232830, 0x00232940, 0x00232b20, 0x00238830,
+  0x00238920, 0x0023cf30, 0x0023d020, 0x0023e950, 0x0023ed30, 0x0023f050, 0x0023f130,
+  0x0023f350, 0x0023f420, 0x0023f830, 0x0023fb20, 0x0024c230, 0x0024c320, 0x0025aa30,
+  0x0025ac20, 0x0025b630, 0x0025b720, 0x0025c030, 0x0025c120, 0x0025fb30, 0x0025fd50,
+  0x0025ff20, 0x00260030, 0x00260620, 0x00260730, 0x00261320, 0x00261450, 0x00261630,
+  0x00263050, 0x00263830, 0x00264850, 0x00265430, 0x00267f50, 0x00268030, 0x00268620,
+  0x00268a40, 0x00269030, 0x00269350, 0x00269430, 0x0026a150, 0x0026a230, 0x0026aa50,
+  0x0026ac30, 0x0026bd50, 0x0026bf30, 0x0026c450, 0x0026c630, 0x0026ce50, 0x0026cf30,
+  0x0026d450, 0x0026d530, 0x0026ea50, 0x0026eb30, 0x0026f250, 0x0026f430, 0x0026f550,
+  0x0026f630, 0x0026fa50, 0x0026fb30, 0x0026fd50, 0x0026fe30, 0x00270550, 0x00270620,
+  0x00270830, 0x00270a50, 0x00270c30, 0x00271320, 0x00271430, 0x00271520, 0x00271630,
+  0x00271720, 0x00271d30, 0x00271e20, 0x00272130, 0x00272220, 0x00272850, 0x00272920,
+  0x00273330, 0x00273520, 0x00274430, 0x00274520, 0x00274730, 0x00274820, 0x00274c50,
+  0x00274d20, 0x00274e50, 0x00274f20, 0x00275350, 0x00275620, 0x00275750, 0x00275820,
+  0x00276330, 0x00276820, 0x00279550, 0x00279820, 0x0027a130, 0x0027a220, 0x0027b050,
+  0x0027b120, 0x0027bf50, 0x0027c020, 0x00293430, 0x00293620, 0x002b0530, 0x002b0820,
+  0x002b1b50, 0x002b1d20, 0x002b5050, 0x002b5120, 0x002b5550, 0x002b5620, 0x002cef04,
+  0x002cf220, 0x002d7f04, 0x002d8020, 0x002de004, 0x002e0020, 0x002e8040, 0x002e9a20,
+  0x002e9b40, 0x002ef420, 0x002f0040, 0x002fd620, 0x002ff040, 0x00302a04, 0x00303050,
+  0x00303140, 0x00303d50, 0x00303e40, 0x00303f20, 0x00304140, 0x00309720, 0x00309904,
+  0x00309b40, 0x00310020, 0x00310540, 0x00313020, 0x00313140, 0x00318f20, 0x00319040,
+  0x0031e620, 0x0031ef40, 0x00321f20, 0x00322040, 0x00324820, 0x00325040, 0x00329750,
+  0x00329840, 0x00329950, 0x00329a40, 0x00a48d20, 0x00a49040, 0x00a4c720, 0x00a66f04,
+  0x00a67320, 0x00a67404, 0x00a67e20, 0x00a69e04, 0x00a6a020, 0x00a6f004, 0x00a6f220,
+  0x00a80204, 0x00a80320, 0x00a80604, 0x00a80720, 0x00a80b04, 0x00a80c20, 0x00a82308,
+  0x00a82504, 0x00a82708, 0x00a82820, 0x00a82c04, 0x00a82d20, 0x00a88008, 0x00a88220,
+  0x00a8b408, 0x00a8c404, 0x00a8c620, 0x00a8e004, 0x00a8f220, 0x00a8ff04, 0x00a90020,
+  0x00a92604, 0x00a92e20, 0x00a94704, 0x00a95208, 0x00a95304, 0x00a95420, 0x00a96049,
+  0x00a97d20, 0x00a98004, 0x00a98308, 0x00a98420, 0x00a9b304, 0x00a9b408, 0x00a9b604,
+  0x00a9ba08, 0x00a9bc04, 0x00a9be08, 0x00a9c004, 0x00a9c120, 0x00a9e504, 0x00a9e620,
+  0x00aa2904, 0x00aa2f08, 0x00aa3104, 0x00aa3308, 0x00aa3504, 0x00aa3720, 0x00aa4304,
+  0x00aa4420, 0x00aa4c04, 0x00aa4d08, 0x00aa4e20, 0x00aa7b00, 0x00aa7c04, 0x00aa7d00,
+  0x00aa7e20, 0x00aab004, 0x00aab120, 0x00aab204, 0x00aab520, 0x00aab704, 0x00aab920,
+  0x00aabe04, 0x00aac020, 0x00aac104, 0x00aac220, 0x00aaeb08, 0x00aaec04, 0x00aaee08,
+  0x00aaf020, 0x00aaf508, 0x00aaf604, 0x00aaf720, 0x00abe308, 0x00abe504, 0x00abe608,
+  0x00abe804, 0x00abe908, 0x00abeb20, 0x00abec08, 0x00abed04, 0x00abee20, 0x00ac0040,
+  0x00d7a420, 0x00d7b00a, 0x00d7c700, 0x00d7cb0b, 0x00d7fc00, 0x00e00020, 0x00f90040,
+  0x00fb0020, 0x00fb1e04, 0x00fb1f20, 0x00fe0004, 0x00fe1040, 0x00fe1a20, 0x00fe2004,
+  0x00fe3040, 0x00fe5320, 0x00fe5440, 0x00fe6720, 0x00fe6840, 0x00fe6c20, 0x00feff03,
+  0x00ff0020, 0x00ff0140, 0x00ff6120, 0x00ff9e04, 0x00ffa020, 0x00ffe040, 0x00ffe720,
+  0x00fff023, 0x00fff903, 0x00fffc20, 0x0101fd04, 0x0101fe20, 0x0102e004, 0x0102e120,
+  0x01037604, 0x01037b20, 0x010a0104, 0x010a0420, 0x010a0504, 0x010a0720, 0x010a0c04,
+  0x010a1020, 0x010a3804, 0x010a3b20, 0x010a3f04, 0x010a4020, 0x010ae504, 0x010ae720,
+  0x010d2404, 0x010d2820, 0x010d6904, 0x010d6e20, 0x010eab04, 0x010ead20, 0x010efa00,
+  0x010efc04, 0x010f0020, 0x010f4604, 0x010f5120, 0x010f8204, 0x010f8620, 0x01100008,
+  0x01100104, 0x01100208, 0x01100320, 0x01103804, 0x01104720, 0x01107004, 0x01107120,
+  0x01107304, 0x01107520, 0x01107f04, 0x01108208, 0x01108320, 0x0110b008, 0x0110b304,
+  0x0110b708, 0x0110b904, 0x0110bb20, 0x0110bd07, 0x0110be20, 0x0110c204, 0x0110c320,
+  0x0110cd07, 0x0110ce20, 0x01110004, 0x01110320, 0x01112704, 0x01112c08, 0x01112d04,
+  0x01113520, 0x01114508, 0x01114720, 0x01117304, 0x01117420, 0x01118004, 0x01118208,
+  0x01118320, 0x0111b308, 0x0111b604, 0x0111bf08, 0x0111c004, 0x0111c120, 0x0111c227,
+  0x0111c420, 0x0111c904, 0x0111cd20, 0x0111ce08, 0x0111cf04, 0x0111d020, 0x01122c08,
+  0x01122f04, 0x01123208, 0x01123404, 0x01123820, 0x01123e04, 0x01123f20, 0x01124104,
+  0x01124220, 0x0112df04, 0x0112e008, 0x0112e304, 0x0112eb20, 0x01130004, 0x01130208,
+  0x01130420, 0x01133b04, 0x01133d20, 0x01133e04, 0x01133f08, 0x01134004, 0x01134108,
+  0x01134520, 0x01134708, 0x01134920, 0x01134b08, 0x01134d04, 0x01134e20, 0x01135704,
+  0x01135820, 0x01136208, 0x01136420, 0x01136604, 0x01136d20, 0x01137004, 0x01137520,
+  0x0113b804, 0x0113b908, 0x0113bb04, 0x0113c120, 0x0113c204, 0x0113c320, 0x0113c504,
+  0x0113c620, 0x0113c704, 0x0113ca08, 0x0113cb20, 0x0113cc08, 0x0113ce04, 0x0113d127,
+  0x0113d204, 0x0113d320, 0x0113e104, 0x0113e320, 0x01143508, 0x01143804, 0x01144008,
+  0x01144204, 0x01144508, 0x01144604, 0x01144720, 0x01145e04, 0x01145f20, 0x0114b004,
+  0x0114b108, 0x0114b304, 0x0114b908, 0x0114ba04, 0x0114bb08, 0x0114bd04, 0x0114be08,
+  0x0114bf04, 0x0114c108, 0x0114c204, 0x0114c420, 0x0115af04, 0x0115b008, 0x0115b204,
+  0x0115b620, 0x0115b808, 0x0115bc04, 0x0115be08, 0x0115bf04, 0x0115c120, 0x0115dc04,
+  0x0115de20, 0x01163008, 0x01163304, 0x01163b08, 0x01163d04, 0x01163e08, 0x01163f04,
+  0x01164120, 0x0116ab04, 0x0116ac08, 0x0116ad04, 0x0116ae08, 0x0116b004, 0x0116b820,
+  0x01171d04, 0x01171e08, 0x01171f04, 0x01172000, 0x01172204, 0x01172608, 0x01172704,
+  0x01172c20, 0x01182c08, 0x01182f04, 0x01183808, 0x01183904, 0x01183b20, 0x01193004,
+  0x01193108, 0x01193620, 0x01193708, 0x01193920, 0x01193b04, 0x01193f27, 0x01194008,
+  0x01194127, 0x01194208, 0x01194304, 0x01194420, 0x0119d108, 0x0119d404, 0x0119d820,
+  0x0119da04, 0x0119dc08, 0x0119e004, 0x0119e120, 0x0119e408, 0x0119e520, 0x011a0104,
+  0x011a0b20, 0x011a3304, 0x011a3908, 0x011a3a27, 0x011a3b04, 0x011a3f20, 0x011a4704,
+  0x011a4820, 0x011a5104, 0x011a5708, 0x011a5904, 0x011a5c20, 0x011a8427, 0x011a8a04,
+  0x011a9708, 0x011a9804, 0x011a9a20, 0x011b6000, 0x011b6820, 0x011c2f08, 0x011c3004,
+  0x011c3720, 0x011c3804, 0x011c3e08, 0x011c3f04, 0x011c4020, 0x011c9204, 0x011ca820,
+  0x011ca908, 0x011caa04, 0x011cb108, 0x011cb204, 0x011cb408, 0x011cb504, 0x011cb720,
+  0x011d3104, 0x011d3720, 0x011d3a04, 0x011d3b20, 0x011d3c04, 0x011d3e20, 0x011d3f04,
+  0x011d4627, 0x011d4704, 0x011d4820, 0x011d8a08, 0x011d8f20, 0x011d9004, 0x011d9220,
+  0x011d9308, 0x011d9504, 0x011d9608, 0x011d9704, 0x011d9820, 0x011ef304, 0x011ef508,
+  0x011ef720, 0x011f0004, 0x011f0227, 0x011f0308, 0x011f0420, 0x011f3408, 0x011f3604,
+  0x011f3b20, 0x011f3e08, 0x011f4004, 0x011f4320, 0x011f5a04, 0x011f5b20, 0x01343003,
+  0x01344004, 0x01344120, 0x01344704, 0x01345620, 0x01611e04, 0x01612a08, 0x01612d04,
+  0x01613020, 0x016af004, 0x016af520, 0x016b3004, 0x016b3720, 0x016d632a, 0x016d6420,
+  0x016d672a, 0x016d6b20, 0x016f4f04, 0x016f5020, 0x016f5108, 0x016f8820, 0x016f8f04,
+  0x016f9320, 0x016fe040, 0x016fe404, 0x016fe520, 0x016ff004, 0x016ff240, 0x016ff720,
+  0x01700040, 0x018cd620, 0x018cff40, 0x018d1f20, 0x018d8040, 0x018df320, 0x01aff040,
+  0x01aff420, 0x01aff540, 0x01affc20, 0x01affd40, 0x01afff20, 0x01b00040, 0x01b12320,
+  0x01b13240, 0x01b13320, 0x01b15040, 0x01b15320, 0x01b15540, 0x01b15620, 0x01b16440,
+  0x01b16820, 0x01b17040, 0x01b2fc20, 0x01bc9d04, 0x01bc9f20, 0x01bca003, 0x01bca420,
+  0x01cf0004, 0x01cf2e20, 0x01cf3004, 0x01cf4720, 0x01d16504, 0x01d16a20, 0x01d16d04,
+  0x01d17303, 0x01d17b04, 0x01d18320, 0x01d18504, 0x01d18c20, 0x01d1aa04, 0x01d1ae20,
+  0x01d24204, 0x01d24520, 0x01d30040, 0x01d35720, 0x01d36040, 0x01d37720, 0x01da0004,
+  0x01da3720, 0x01da3b04, 0x01da6d20, 0x01da7504, 0x01da7620, 0x01da8404, 0x01da8520,
+  0x01da9b04, 0x01daa020, 0x01daa104, 0x01dab020, 0x01e00004, 0x01e00720, 0x01e00804,
+  0x01e01920, 0x01e01b04, 0x01e02220, 0x01e02304, 0x01e02520, 0x01e02604, 0x01e02b20,
+  0x01e08f04, 0x01e09020, 0x01e13004, 0x01e13720, 0x01e2ae04, 0x01e2af20, 0x01e2ec04,
+  0x01e2f020, 0x01e4ec04, 0x01e4f020, 0x01e5ee04, 0x01e5f020, 0x01e6e300, 0x01e6e420,
+  0x01e6e600, 0x01e6e720, 0x01e6ee00, 0x01e6f020, 0x01e6f500, 0x01e6f620, 0x01e8d004,
+  0x01e8d720, 0x01e94404, 0x01e94b20, 0x01f00030, 0x01f00450, 0x01f00530, 0x01f0cf50,
+  0x01f0d030, 0x01f10020, 0x01f10d30, 0x01f11020, 0x01f12f30, 0x01f13020, 0x01f16c30,
+  0x01f17220, 0x01f17e30, 0x01f18020, 0x01f18e50, 0x01f18f20, 0x01f19150, 0x01f19b20,
+  0x01f1ad30, 0x01f1e626, 0x01f20040, 0x01f20150, 0x01f20330, 0x01f21040, 0x01f21a50,
+  0x01f21b40, 0x01f22f50, 0x01f23040, 0x01f23250, 0x01f23b40, 0x01f23c30, 0x01f24040,
+  0x01f24930, 0x01f25050, 0x01f25230, 0x01f26050, 0x01f26630, 0x01f30050, 0x01f32130,
+  0x01f32d50, 0x01f33630, 0x01f33750, 0x01f37d30, 0x01f37e50, 0x01f39430, 0x01f3a050,
+  0x01f3cb30, 0x01f3cf50, 0x01f3d430, 0x01f3e050, 0x01f3f130, 0x01f3f450, 0x01f3f530,
+  0x01f3f850, 0x01f3fb04, 0x01f40050, 0x01f43f30, 0x01f44050, 0x01f44130, 0x01f44250,
+  0x01f4fd30, 0x01f4ff50, 0x01f53e20, 0x01f54630, 0x01f54b50, 0x01f54f30, 0x01f55050,
+  0x01f56830, 0x01f57a50, 0x01f57b30, 0x01f59550, 0x01f59730, 0x01f5a450, 0x01f5a530,
+  0x01f5fb50, 0x01f65020, 0x01f68050, 0x01f6c630, 0x01f6cc50, 0x01f6cd30, 0x01f6d050,
+  0x01f6d330, 0x01f6d550, 0x01f6d930, 0x01f6dc50, 0x01f6e030, 0x01f6eb50, 0x01f6ed30,
+  0x01f6f450, 0x01f6fd30, 0x01f70020, 0x01f77430, 0x01f78020, 0x01f7d530, 0x01f7e050,
+  0x01f7ec30, 0x01f7f050, 0x01f7f130, 0x01f80020, 0x01f80c30, 0x01f81020, 0x01f84830,
+  0x01f85020, 0x01f85a30, 0x01f86020, 0x01f88830, 0x01f89020, 0x01f8ae30, 0x01f90020,
+  0x01f90c50, 0x01f93b20, 0x01f93c50, 0x01f94620, 0x01f94750, 0x01fa0030, 0x01fa7050,
+  0x01fa7d30, 0x01fa8050, 0x01fa8b30, 0x01fa8e50, 0x01fac730, 0x01fac850, 0x01fac930,
+  0x01facd50, 0x01fadd30, 0x01fadf50, 0x01faeb30, 0x01faef50, 0x01faf930, 0x01fb0020,
+  0x01fc0030, 0x01fffe20, 0x02000040, 0x02fffe20, 0x03000040, 0x03fffe20, 0x0e000023,
+  0x0e000103, 0x0e000223, 0x0e002004, 0x0e008023, 0x0e010004, 0x0e01f023, 0x0e100020
+};
+
+#define UNICODE_PICTOGRAPHIC 0x10
+#define UNICODE_WIDTH(props) (((props) >> 5) & 3)
+
+// Returns the properties of code point cp, by a binary search over the runs.
+unsigned char unicodeProps(uint32_t cp){
+  if (cp >= 0xac00 && cp <= 0xd7a3) {
+    return ((cp - 0xac00) % 28 == 0 ? GCB_LV : GCB_LVT) | (2 << 5);
+  }
+  int lo = 0, hi = sizeof(unicodeTable) / sizeof(unicodeTable[0]) - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (unicodeTable[mid] >> 8 <= cp) lo = mid; else hi = mid - 1;
+  }
+  return unicodeTable[lo] & 0xff;
+}
+
+/*
+Decodes the UTF-8 sequence at the start of s, at most len bytes, into *cp and returns
+its length. A byte that does not start a valid sequence decodes on its own to U+FFFD,
+the replacement character.
+*/
+int utf8Decode(const char *s, size_t len, uint32_t *cp){
+  const unsigned char *u = (const unsigned char *)s;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+  int n = u[0] >= 0xf0 && u[0] < 0xf5 ? 4 : u[0] >= 0xe0 ? 3 : u[0] >= 0xc2 && u[0] < 0xe0 ? 2 : 0;
+  if (n == 0 || (size_t)n > len) {
+    *cp = 0xfffd;
+    return 1;
+  }
+  uint32_t c = u[0] & (0x7f >> n);
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) {
+      *cp = 0xfffd;
+      return 1;
+    }
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+  // Overlong forms and surrogates are not valid either.
+  if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff)) || (c >= 0xd800 && c < 0xe000)) {
+    *cp = 0xfffd;
+    return 1;
+  }
+  *cp = c;
+  return n;
+}
+
+// Writes code point cp as UTF-8 to buf and returns the number of bytes.
+int utf8Encode(uint32_t cp, char *buf){
+  if (cp < 0x80) {
+    buf[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    buf[0] = 0xc0 | (cp >> 6);
+    buf[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    buf[0] = 0xe0 | (cp >> 12);
+    buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+    buf[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  buf[0] = 0xf0 | (cp >> 18);
+  buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+  buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+  buf[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+/*
+Returns whether there is no cluster boundary between two code points with properties
+prev and next (the rules of UAX #29, numbered as there). regional is the number of
+regional indicators in the cluster so far, and pictograph is 1 after an
+Extended_Pictographic followed by Extend characters and 2 once a ZWJ follows that.
+The Indic conjunct rule GB9c is not applied.
+*/
+int graphemeJoins(unsigned char prev, unsigned char next, int regional, int pictograph){
+  int a = prev & 0x0f, b = next & 0x0f;
+  // GB3, GB4, GB5: CR LF stays together, other controls stand alone.
+  if (a == GCB_CR && b == GCB_LF) return 1;
+  if (a == GCB_CR || a == GCB_LF || a == GCB_CONTROL) return 0;
+  if (b == GCB_CR || b == GCB_LF || b == GCB_CONTROL) return 0;
+  // GB6, GB7, GB8: Hangul syllable sequences.
+  if (a == GCB_L && (b == GCB_L || b == GCB_V || b == GCB_LV || b == GCB_LVT)) return 1;
+  if ((a == GCB_LV || a == GCB_V) && (b == GCB_V || b == GCB_T)) return 1;
+  if ((a == GCB_LVT || a == GCB_T) && b == GCB_T) return 1;
+  // GB9, GB9a, GB9b: combining marks attach to what is before them.
+  if (b == GCB_EXTEND || b == GCB_ZWJ || b == GCB_SPACINGMARK) return 1;
+  if (a == GCB_PREPEND) return 1;
+  // GB11: emoji ZWJ sequences.
+  if (a == GCB_ZWJ && pictograph == 2 && (next & UNICODE_PICTOGRAPHIC)) return 1;
+  // GB12, GB13: regional indicators pair up into flags.
+  if (a == GCB_REGIONAL_INDICATOR && b == GCB_REGIONAL_INDICATOR && regional % 2 == 1) return 1;
+  return 0;
+}
+
+/*
+Returns the end of the extended grapheme cluster starting at byte pos of s, and its
+width in columns in *width. ASCII text takes a fast path: an ASCII character
+followed by another one or by the end is a cluster of its own (unless it is CR LF),
+so the tables are only looked at next to non-ASCII bytes.
+*/
+size_t graphemeNext(const char *s, size_t len, size_t pos, int *width){
+  unsigned char c = s[pos];
+  if (c < 0x80 && (pos + 1 == len || ((unsigned char)s[pos + 1] < 0x80 && !(c == '\r' && s[pos + 1] == '\n')))) {
+    *width = 1;
+    return pos + 1;
+  }
+  uint32_t cp;
+  size_t end = pos + utf8Decode(s + pos, len - pos, &cp);
+  unsigned char props = unicodeProps(cp);
+  int w = UNICODE_WIDTH(props);
+  int regional = (props & 0x0f) == GCB_REGIONAL_INDICATOR;
+  int pictograph = props & UNICODE_PICTOGRAPHIC ? 1 : 0;
+  while (end < len) {
+    int n = utf8Decode(s + end, len - end, &cp);
+    unsigned char next = unicodeProps(cp);
+    if (!graphemeJoins(props, next, regional, pictograph)) break;
+    if ((next & 0x0f) == GCB_REGIONAL_INDICATOR) regional++;
+    if (next & UNICODE_PICTOGRAPHIC) pictograph = 1;
+    else if (pictograph == 1 && (next & 0x0f) == GCB_ZWJ) pictograph = 2;
+    else if (!(pictograph == 1 && (next & 0x0f) == GCB_EXTEND)) pictograph = 0;
+    if ((int)UNICODE_WIDTH(next) > w) w = UNICODE_WIDTH(next);
+    // Variation selector 16 asks for the wide emoji presentation.
+    if (cp == 0xfe0f) w = 2;
+    props = next;
+    end += n;
+  }
+  // A pair of regional indicators is a flag, shown two columns wide.
+  if (regional == 2) w = 2;
+  *width = w;
+  return end;
+}
+
+/*
+Returns the start of the cluster holding byte pos of s. Clusters are only found by
+walking forwards, so the walk starts from the nearest earlier point that is surely a
+boundary: the start of s, or between two ASCII characters other than CR LF.
+*/
+size_t graphemeStart(const char *s, size_t len, size_t pos){
+  if (pos >= len) return len;
+  size_t p = pos;
+  while (p > 0 && !((unsigned char)s[p - 1] < 0x80 && (unsigned char)s[p] < 0x80 &&
+                    !(s[p - 1] == '\r' && s[p] == '\n'))) {
+    p--;
+  }
+  int width;
+  for (;;) {
+    size_t next = graphemeNext(s, len, p, &width);
+    if (next > pos) return p;
+    p = next;
+  }
+}
+
+// Returns the start of the cluster before byte pos of s.
+size_t graphemePrev(const char *s, size_t len, size_t pos){
+  return pos == 0 ? 0 : graphemeStart(s, len, pos - 1);
+}
+
+/*
+The functions below work on the text of a line in two pieces, as lineGetText() gives
+it, so the active line is read without moving its gap. Edits only ever split the text
+between code points, so only clusters can straddle the gap.
+*/
+
+// Returns byte pos of text.
+char textByte(const struct lineText *text, size_t pos){
+  return pos < text->size[0] ? text->chars[0][pos] : text->chars[1][pos - text->size[0]];
+}
+
+// Copies bytes [from, to) of text to dst.
+void textCopy(const struct lineText *text, size_t from, size_t to, char *dst){
+  if (from < text->size[0]) {
+    size_t n = (to < text->size[0] ? to : text->size[0]) - from;
+    memcpy(dst, text->chars[0] + from, n);
+    dst += n;
+    from += n;
+  }
+  if (from < to) memcpy(dst, text->chars[1] + from - text->size[0], to - from);
+}
+
+/*
+Returns the end of the cluster starting at byte pos of text, and its width in *width.
+A cluster that runs up to the gap is measured again on a copy of the bytes around the
+gap, which is cut short only for clusters longer than GRAPHEME_MAX_BYTES.
+*/
+size_t textNextCluster(const struct lineText *text, size_t pos, int *width){
+  if (pos >= text->size[0]) {
+    return text->size[0] + graphemeNext(text->chars[1], text->size[1], pos - text->size[0], width);
+  }
+  size_t end = graphemeNext(text->chars[0], text->size[0], pos, width);
+  if (end < text->size[0] || text->size[1] == 0 || end - pos > GRAPHEME_MAX_BYTES) return end;
+  char seam[2 * GRAPHEME_MAX_BYTES];
+  size_t head = end - pos;
+  size_t tail = text->size[1] < GRAPHEME_MAX_BYTES ? text->size[1] : GRAPHEME_MAX_BYTES;
+  memcpy(seam, text->chars[0] + pos, head);
+  memcpy(seam + head, text->chars[1], tail);
+  return pos + graphemeNext(seam, head + tail, 0, width);
+}
+
+// Returns the start of the cluster holding byte pos of text.
+size_t textClusterStart(const struct lineText *text, size_t pos){
+  size_t size = text->size[0] + text->size[1];
+  if (pos >= size) return size;
+  if (pos < text->size[0]) return graphemeStart(text->chars[0], text->size[0], pos);
+  // Walk from the last cluster before the gap to the first boundary after it, the
+  // text from there on holds whole clusters.
+  size_t p = text->size[0] ? graphemeStart(text->chars[0], text->size[0], text->size[0] - 1) : 0;
+  int width;
+  while (p < text->size[0]) {
+    size_t next = textNextCluster(text, p, &width);
+    if (next > pos) return p;
+    p = next;
+  }
+  return p + graphemeStart(text->chars[1] + p - text->size[0], size - p, pos - p);
+}
+
+// Returns the start of the cluster before byte pos of text.
+size_t textPrevCluster(const struct lineText *text, size_t pos){
+  return pos == 0 ? 0 : textClusterStart(text, pos - 1);
+}
+
+/*
+Returns the cell glyph for the cluster of len bytes at s: its code point when it
+has only one, otherwise its index in the grapheme table. Clusters that do not fit
+the table are shown as their first code point.
+*/
+uint32_t graphemeGlyph(const char *s, size_t len){
+  uint32_t cp;
+  if ((size_t)utf8Decode(s, len, &cp) == len || len >= GRAPHEME_MAX_BYTES) return cp;
+  struct graphemeTable *table = &E.graphemes;
+  if (table->entries == NULL) {
+    table->entries = memCalloc(MEM_RENDER, GRAPHEME_TABLE_SIZE, sizeof(struct graphemeEntry));
+  }
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+  for (uint32_t i = h & (GRAPHEME_TABLE_SIZE - 1);; i = (i + 1) & (GRAPHEME_TABLE_SIZE - 1)) {
+    struct graphemeEntry *entry = &table->entries[i];
+    if (entry->size == len && memcmp(entry->bytes, s, len) == 0) return CELL_GRAPHEME | i;
+    if (entry->size == 0) {
+      // Keep a quarter of the slots free so probes stay short.
+      if (table->count >= GRAPHEME_TABLE_SIZE * 3 / 4) return cp;
+      entry->size = len;
+      memcpy(entry->bytes, s, len);
+      table->count++;
+      return CELL_GRAPHEME | i;
+    }
+  }
+}
+
+/*
+Returns whether text may hold right-to-left characters, looking only at bytes: the
+lead bytes of Hebrew, Arabic, Syriac, Thaana and NKo (U+0590-U+07FF), and the three
+and four byte forms of the other right-to-left blocks. ASCII and most other text
+is rejected by one comparison per byte.
+*/
+int bidiMayHaveRtl(const char *s, size_t len){
+  const unsigned char *u = (const unsigned char *)s;
+  for (size_t i = 0; i < len; i++) {
+    if (u[i] < 0xd6) continue;
+    if (u[i] <= 0xdf) return 1;
+    if (i + 1 == len) break;
+    // U+0800-U+08FF, Samaritan to Arabic Extended.
+    if (u[i] == 0xe0 && u[i + 1] >= 0xa0 && u[i + 1] <= 0xa3) return 1;
+    // U+FB1D-U+FDFF and U+FE70-U+FEFF, Hebrew and Arabic presentation forms.
+    if (u[i] == 0xef && u[i + 1] >= 0xac && u[i + 1] <= 0xbb) return 1;
+    // U+10800-U+10FFF and U+1E800-U+1EFFF.
+    if (u[i] == 0xf0 && ((u[i + 1] == 0x90 && i + 2 < len && u[i + 2] >= 0xa0) || u[i + 1] == 0x9e)) return 1;
+  }
+  return 0;
+}
+
+// Bidirectional types, reduced to the ones the display order needs.
+enum bidiType {
+  BIDI_L = 0,
+  BIDI_R,
+  BIDI_NUMBER,
+  BIDI_NEUTRAL
+};
+
+/*
+Returns the bidirectional type of code point cp. Right-to-left blocks are strong
+right-to-left except for their digits, spaces and punctuation are neutral, and
+everything else is taken as left-to-right.
+*/
+enum bidiType bidiTypeOf(uint32_t cp){
+  if (cp < 0x80) {
+    if (isdigit(cp)) return BIDI_NUMBER;
+    return isalpha(cp) ? BIDI_L : BIDI_NEUTRAL;
+  }
+  if ((cp >= 0x660 && cp <= 0x669) || (cp >= 0x6f0 && cp <= 0x6f9)) return BIDI_NUMBER;
+  if ((cp >= 0x590 && cp <= 0x8ff) || (cp >= 0xfb1d && cp <= 0xfdff) || (cp >= 0xfe70 && cp <= 0xfeff) ||
+      (cp >= 0x10800 && cp <= 0x10fff) || (cp >= 0x1e800 && cp <= 0x1efff)) {
+    return BIDI_R;
+  }
+  if (cp == 0xa0 || (cp >= 0x2000 && cp <= 0x206f) || (cp >= 0x3000 && cp <= 0x303f)) return BIDI_NEUTRAL;
+  return BIDI_L;
+}
+
+/*** task pool ***/
+
+/*
+Pushes a task at the bottom of a deque. Only the owner may call this.
+Returns 0 when the deque is full.
+*/
+int taskDequePush(struct taskDeque *deque, struct task *task){
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= TASK_DEQUE_CAPACITY) return 0;
+  __atomic_store_n(&deque->buffer[bottom & (TASK_DEQUE_CAPACITY - 1)], task, __ATOMIC_RELAXED);
+  // Release: the task must be visible before thieves can see the new bottom.
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+Takes the most recently pushed task from the bottom of a deque. Only the owner may
+call this. When one task is left the owner races the thieves for it on top.
+*/
+struct task *taskDequeTake(struct taskDeque *deque){
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  struct task *task = NULL;
+  if (top <= bottom) {
+    task = __atomic_load_n(&deque->buffer[bottom & (TASK_DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        task = NULL;
+      }
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+// Steals the oldest task from the top of another thread's deque. Returns NULL when the
+// deque is empty or another thread won the race.
+struct task *taskDequeSteal(struct taskDeque *deque){
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return NULL;
+  struct task *task = __atomic_load_n(&deque->buffer[top & (TASK_DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return task;
+}
+
+struct cancelToken *cancelTokenNew(enum memCategory category){
+  struct cancelToken *token = memAlloc(category, sizeof(struct cancelToken));
+  token->cancelled = 0;
+  token->refs = 1;
+  token->category = category;
+  return token;
+}
+
+void cancelTokenCancel(struct cancelToken *token){
+  __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+// Long running tasks call this between steps and return early when it is set.
+int cancelTokenIsCancelled(struct cancelToken *token){
+  return token && __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE);
+}
+
+void cancelTokenRelease(struct cancelToken *token){
+  if (token && __atomic_sub_fetch(&token->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    memFree(token->category, token, sizeof(struct cancelToken));
+  }
+}
+
+/*
+Runs a task and queues it for completion on the main thread.
+Cancelled tasks skip run but are still completed, so their memory is freed.
+*/
+void taskExecute(struct task *task){
+  if (!cancelTokenIsCancelled(task->token)) task->run(task);
+  struct task *head = __atomic_load_n(&E.pool.completed, __ATOMIC_RELAXED);
+  do {
+    task->next = head;
+  } while (!__atomic_compare_exchange_n(&E.pool.completed, &head, task, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  // The pipe is non-blocking; when it is full the event loop is already going to wake up.
+  char byte = 1;
+  if (write(E.pool.notifyPipe[1], &byte, 1) == -1) {
+    // Nothing to do.
+  }
+}
+
+/*
+Finds a task for the thread owning the deques at self. Higher priorities first;
+within a priority the own deque first, then the other threads' deques.
+*/
+struct task *taskFind(int self){
+  int participants = E.pool.numWorkers + 1;
+  for (int priority = 0; priority < TASK_PRIORITIES; priority++) {
+    struct task *task = taskDequeTake(&E.pool.deques[self][priority]);
+    for (int k = 1; task == NULL && k < participants; k++) {
+      task = taskDequeSteal(&E.pool.deques[(self + k) % participants][priority]);
+    }
+    if (task) {
+      __atomic_sub_fetch(&E.pool.pending, 1, __ATOMIC_RELAXED);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+void *taskWorkerMain(void *arg){
+  taskSelf = (int)(intptr_t)arg;
+  while (1) {
+    struct task *task = taskFind(taskSelf);
+    if (task) {
+      taskExecute(task);
+      continue;
+    }
+    pthread_mutex_lock(&E.pool.lock);
+    while (__atomic_load_n(&E.pool.pending, __ATOMIC_RELAXED) == 0) {
+      pthread_cond_wait(&E.pool.wake, &E.pool.lock);
+    }
+    pthread_mutex_unlock(&E.pool.lock);
+  }
+  return NULL;
+}
+
+/*
+Queues a task on the calling thread's deque. token may be NULL for tasks that are
+never cancelled. When the deque is full the task runs right away instead.
+*/
+void taskSubmit(struct task *task, struct cancelToken *token, enum taskPriority priority){
+  task->token = token;
+  task->priority = priority;
+  if (token) __atomic_add_fetch(&token->refs, 1, __ATOMIC_RELAXED);
+  if (!taskDequePush(&E.pool.deques[taskSelf][priority], task)) {
+    taskExecute(task);
+    return;
+  }
+  __atomic_add_fetch(&E.pool.pending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&E.pool.lock);
+  pthread_cond_signal(&E.pool.wake);
+  pthread_mutex_unlock(&E.pool.lock);
+}
+
+/*
+Completes the tasks that finished since the last call, in the order they finished.
+Runs on the main thread only.
+*/
+void taskPoolDrain(){
+  char buf[256];
+  while (read(E.pool.notifyPipe[0], buf, sizeof(buf)) > 0);
+
+  struct task *list = __atomic_exchange_n(&E.pool.completed, NULL, __ATOMIC_ACQUIRE);
+  // The list is a stack, reverse it to complete in finishing order.
+  struct task *ordered = NULL;
+  while (list) {
+    struct task *next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+  while (ordered) {
+    struct task *next = ordered->next;
+    struct cancelToken *token = ordered->token;
+    if (ordered->complete) ordered->complete(ordered);
+    cancelTokenRelease(token);
+    ordered = next;
+  }
+}
+
+/*
+Blocks the main thread until *remaining drops to 0. Meanwhile the main thread runs
+queued tasks itself and completes finished ones, which is what decrements remaining.
+*/
+void taskPoolWait(int *remaining){
+  while (*remaining > 0) {
+    struct task *task = taskFind(E.pool.numWorkers);
+    if (task) {
+      taskExecute(task);
+      continue;
+    }
+    taskPoolDrain();
+    if (*remaining == 0) break;
+    struct pollfd fd = {E.pool.notifyPipe[0], POLLIN, 0};
+    if (poll(&fd, 1, -1) == -1 && errno != EINTR) die("taskPoolWait - poll");
+  }
+}
+
+// Starts one worker per processor besides the one the main thread runs on.
+void taskPoolInit(){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = cpus > 1 ? cpus - 1 : 1;
+  if (workers > TASK_POOL_MAX_WORKERS) workers = TASK_POOL_MAX_WORKERS;
+  E.pool.numWorkers = workers;
+
+  void *deques;
+  size_t size = sizeof(struct taskDeque) * TASK_PRIORITIES * (workers + 1);
+  if (posix_memalign(&deques, CACHE_LINE_SIZE, size) != 0) die("taskPoolInit - posix_memalign");
+  memset(deques, 0, size);
+  E.pool.deques = deques;
+
+  if (pipe(E.pool.notifyPipe) == -1) die("taskPoolInit - pipe");
+  for (int i = 0; i < 2; i++) {
+    fcntl(E.pool.notifyPipe[i], F_SETFL, fcntl(E.pool.notifyPipe[i], F_GETFL) | O_NONBLOCK);
+  }
+  pthread_mutex_init(&E.pool.lock, NULL);
+  pthread_cond_init(&E.pool.wake, NULL);
+
+  taskSelf = workers;
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&E.pool.workers[i], NULL, taskWorkerMain, (void *)(intptr_t)i) != 0) {
+      die("taskPoolInit - pthread_create");
+    }
+  }
+}
+
+/*** line index ***/
+
+// Allocates a zeroed block, aligned to a cache line.
+lineBlock *lineBlockAlloc(){
+  void *block;
+  if (posix_memalign(&block, CACHE_LINE_SIZE, sizeof(lineBlock)) != 0) {
+    die("lineBlockAlloc - posix_memalign");
+  }
+  memAccount(MEM_LINE_INDEX, sizeof(lineBlock), 0);
+  memset(block, 0, sizeof(lineBlock));
+  ((lineBlock *)block)->epoch = E.epoch;
+  return block;
+}
+
+// Frees a block and its edited rows.
+// Render caches are left alone, they belong to the editor's copy of the block.
+void lineBlockFree(lineBlock *block){
+  if (block->rows) {
+    for (int slot = 0; slot < LINE_BLOCK_SIZE; slot++) {
+      editRow *row = &block->rows[slot];
+      if ((block->dirty[slot / 64] >> (slot % 64) & 1) && row->capacity > ROW_INLINE_SIZE) {
+        memFree(MEM_EDIT_ROWS, row->chars.heap, row->capacity);
+      }
+    }
+    memFree(MEM_EDIT_ROWS, block->rows, sizeof(editRow) * LINE_BLOCK_SIZE);
+  }
+  free(block);
+  memAccount(MEM_LINE_INDEX, 0, sizeof(lineBlock));
+}
+
+// Allocates an empty node of the line index tree.
+struct lineNode *lineNodeAlloc(){
+  struct lineNode *node = memCalloc(MEM_LINE_INDEX, 1, sizeof(struct lineNode));
+  node->epoch = E.epoch;
+  return node;
+}
+
+// Frees a node. Its children are not touched, they are retired on their own.
+void lineNodeFree(struct lineNode *node){
+  memFree(MEM_LINE_INDEX, node, sizeof(struct lineNode));
+}
+
+// Allocates a root with no tree under it.
+struct lineIndex *lineIndexAlloc(){
+  struct lineIndex *index = memCalloc(MEM_LINE_INDEX, 1, sizeof(struct lineIndex));
+  index->epoch = E.epoch;
+  return index;
+}
+
+// Returns an index of no lines: a root node over one empty block.
+struct lineIndex *lineIndexNew(){
+  struct lineIndex *index = lineIndexAlloc();
+  index->root = lineNodeAlloc();
+  index->root->children[0] = lineBlockAlloc();
+  index->root->count = 1;
+  index->height = 1;
+  return index;
+}
+
+// Frees a root. Its nodes are not touched, they are retired on their own.
+void lineIndexFree(struct lineIndex *index){
+  memFree(MEM_LINE_INDEX, index, sizeof(struct lineIndex));
+}
+
+// Returns whether a live snapshot may see what was created in epoch.
+int epochIsShared(unsigned long epoch){
+  return E.numSnapshots > 0 && E.snapshots[E.numSnapshots - 1]->epoch >= epoch;
+}
+
+// Hands a root, node or block the editor no longer uses over to the snapshots that still see it.
+void epochRetire(void *ptr, enum retiredKind kind){
+  struct retired *r = memAlloc(MEM_LINE_INDEX, sizeof(struct retired));
+  r->ptr = ptr;
+  r->kind = kind;
+  r->epoch = E.snapshots[E.numSnapshots - 1]->epoch;
+  r->next = E.retired;
+  E.retired = r;
+}
+
+// Frees everything retired after the oldest live snapshot was released.
+void epochReclaim(){
+  struct retired **link = &E.retired;
+  while (*link) {
+    struct retired *r = *link;
+    if (E.numSnapshots > 0 && E.snapshots[0]->epoch <= r->epoch) {
+      link = &r->next;
+      continue;
+    }
+    switch (r->kind) {
+      case RETIRED_ROOT: lineIndexFree(r->ptr); break;
+      case RETIRED_NODE: lineNodeFree(r->ptr); break;
+      case RETIRED_BLOCK: lineBlockFree(r->ptr); break;
+    }
+    *link = r->next;
+    memFree(MEM_LINE_INDEX, r, sizeof(struct retired));
+  }
+}
+
+/*
+Takes a snapshot of the document: an immutable view of every line as it is now.
+Pending edits of the active line are flushed first. Taking a snapshot only starts a
+new epoch; the cost is paid by the next edit, which copies the root, the nodes on the
+way down and the block it writes to.
+*/
+struct snapshot *editorSnapshot(){
+  editorFlushActiveLine();
+  struct snapshot *snap = memAlloc(MEM_LINE_INDEX, sizeof(struct snapshot));
+  snap->index = E.index;
+  snap->epoch = E.epoch++;
+  snap->version = E.version;
+  if (E.numSnapshots == E.snapshotCapacity) {
+    int capacity = E.snapshotCapacity ? E.snapshotCapacity * 2 : 8;
+    E.snapshots = memRealloc(MEM_LINE_INDEX, E.snapshots, sizeof(struct snapshot *) * E.snapshotCapacity,
+                             sizeof(struct snapshot *) * capacity);
+    E.snapshotCapacity = capacity;
+  }
+  E.snapshots[E.numSnapshots++] = snap;
+  return snap;
+}
+
+// Drops a snapshot, freeing what only it and older snapshots could still see.
+void snapshotRelease(struct snapshot *snap){
+  int i = 0;
+  while (E.snapshots[i] != snap) i++;
+  memmove(&E.snapshots[i], &E.snapshots[i + 1], sizeof(struct snapshot *) * (E.numSnapshots - i - 1));
+  E.numSnapshots--;
+  memFree(MEM_LINE_INDEX, snap, sizeof(struct snapshot));
+  epochReclaim();
+}
+
+// Copies the editor's root if a snapshot shares it, so it can be changed.
+// The root only holds the top of the tree, so this is cheap.
+void lineIndexMakeWritable(){
+  struct lineIndex *old = E.index;
+  if (!epochIsShared(old->epoch)) return;
+  struct lineIndex *index = lineIndexAlloc();
+  index->root = old->root;
+  index->height = old->height;
+  index->numLines = old->numLines;
+  E.index = index;
+  epochRetire(old, RETIRED_ROOT);
+}
+
+/*
+Walks down an index to line at, filling path with the nodes on the way, the block
+holding the line and its slot in the block. Line numLines, one past the end, is found
+after the last line of the last block. Safe to call from any thread on a snapshot.
+*/
+void lineIndexWalk(struct lineIndex *index, int at, struct linePath *path){
+  struct lineNode *node = index->root;
+  for (int level = 0; level < index->height; level++) {
+    int i = 0;
+    while (i < node->count - 1 && at >= node->lines[i]) at -= node->lines[i++];
+    path->nodes[level] = node;
+    path->child[level] = i;
+    node = node->children[i];
+  }
+  path->block = (lineBlock *)node;
+  path->slot = at;
+}
+
+// Returns the block of an index holding line at, and sets slot to its place in it.
+lineBlock *lineIndexFind(struct lineIndex *index, int at, int *slot){
+  struct linePath path;
+  lineIndexWalk(index, at, &path);
+  *slot = path.slot;
+  return path.block;
+}
+
+/*
+Walks down the editor's index to line at, through the line cache when the line is in
+the block it holds. Line numLines is found at the end of the last block.
+The path found becomes the new line cache.
+*/
+void lineIndexPath(int at, struct linePath *path){
+  struct lineCache *cache = &E.lineCache;
+  if (cache->valid && at >= cache->first &&
+      (at - cache->first < cache->path.block->count ||
+       (at == E.index->numLines && cache->first + cache->path.block->count == at))) {
+    *path = cache->path;
+    path->slot = at - cache->first;
+    return;
+  }
+  lineIndexWalk(E.index, at, path);
+  cache->path = *path;
+  cache->first = at - path->slot;
+  cache->valid = 1;
+}
+
+// Copies a block, so the copy can be changed while snapshots keep the original.
+// Edited rows are deep copied, the copy takes over the render caches.
+lineBlock *lineBlockCopy(lineBlock *old){
+  lineBlock *block = lineBlockAlloc();
+  memcpy(block, old, sizeof(lineBlock));
+  block->epoch = E.epoch;
+  if (old->rows) {
+    block->rows = memAlloc(MEM_EDIT_ROWS, sizeof(editRow) * LINE_BLOCK_SIZE);
+    memcpy(block->rows, old->rows, sizeof(editRow) * LINE_BLOCK_SIZE);
+    for (int slot = 0; slot < block->count; slot++) {
+      editRow *row = &block->rows[slot];
+      if ((block->dirty[slot / 64] >> (slot % 64) & 1) && row->capacity > ROW_INLINE_SIZE) {
+        char *heap = memAlloc(MEM_EDIT_ROWS, row->capacity);
+        memcpy(heap, old->rows[slot].chars.heap, row->size);
+        row->chars.heap = heap;
+      }
+    }
+  }
+  return block;
+}
+
+/*
+Walks down the editor's index to line at like lineIndexPath(), ready to write: the
+root, the nodes on the path and the block are copied first when a snapshot shares
+them, and the copies are linked in place of the originals. Only the path is copied,
+so an edit costs the height of the tree however many lines there are.
+*/
+void lineIndexWritablePath(int at, struct linePath *path){
+  lineIndexMakeWritable();
+  lineIndexPath(at, path);
+  int copied = 0;
+  for (int level = 0; level < E.index->height; level++) {
+    struct lineNode *node = path->nodes[level];
+    if (!epochIsShared(node->epoch)) continue;
+    copied = 1;
+    struct lineNode *copy = lineNodeAlloc();
+    memcpy(copy, node, sizeof(struct lineNode));
+    copy->epoch = E.epoch;
+    if (level == 0) E.index->root = copy;
+    else path->nodes[level - 1]->children[path->child[level - 1]] = copy;
+    path->nodes[level] = copy;
+    epochRetire(node, RETIRED_NODE);
+  }
+  if (epochIsShared(path->block->epoch)) {
+    copied = 1;
+    lineBlock *old = path->block;
+    path->block = lineBlockCopy(old);
+    path->nodes[E.index->height - 1]->children[path->child[E.index->height - 1]] = path->block;
+    epochRetire(old, RETIRED_BLOCK);
+  }
+  if (copied) E.lineCache.path = *path;
+}
+
+// Returns the block holding line at, ready to be written, and sets slot to its place in it.
+lineBlock *lineBlockWritable(int at, int *slot){
+  struct linePath path;
+  lineIndexWritablePath(at, &path);
+  *slot = path.slot;
+  return path.block;
+}
+
+// Returns the text of a line in a snapshot. Safe to call from any thread.
+const char *snapshotLineChars(struct lineIndex *index, int at, size_t *size){
+  int slot;
+  lineBlock *block = lineIndexFind(index, at, &slot);
+  *size = block->size[slot];
+  if ((block->dirty[slot / 64] >> (slot % 64)) & 1) {
+    editRow *row = &block->rows[slot];
+    return row->capacity <= ROW_INLINE_SIZE ? row->chars.inlined : row->chars.heap;
+  }
+  return E.text.data + block->offset[slot];
+}
+
+// Returns the text buffer position of the first line under a child levels above the blocks.
+size_t lineSubtreeOffset(void *child, int levels){
+  while (levels-- > 0) child = ((struct lineNode *)child)->children[0];
+  return ((lineBlock *)child)->offset[0];
+}
+
+/*
+Returns the line of a snapshot that the text buffer position offset belongs to, by
+binary search over line start offsets: over the children of each node on the way
+down, by the offset of their first line, and then within one block.
+Offsets never decrease, edited and inserted lines keep the offset they were created with.
+*/
+int snapshotLineAtOffset(struct lineIndex *index, size_t offset){
+  if (index->numLines == 0) return 0;
+  int first = 0;
+  struct lineNode *node = index->root;
+  for (int level = 0; level < index->height; level++) {
+    int lo = 0, hi = node->count - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (lineSubtreeOffset(node->children[mid], index->height - 1 - level) <= offset) lo = mid; else hi = mid - 1;
+    }
+    for (int i = 0; i < lo; i++) first += node->lines[i];
+    node = node->children[lo];
+  }
+  lineBlock *block = (lineBlock *)node;
+  int l = 0, h = block->count - 1;
+  while (l < h) {
+    int mid = (l + h + 1) / 2;
+    if (block->offset[mid] <= offset) l = mid; else h = mid - 1;
+  }
+  return first + l;
+}
+
+// Returns the block holding the metadata of line at, and sets slot to its place in it.
+lineBlock *lineBlockOf(int at, int *slot){
+  struct linePath path;
+  lineIndexPath(at, &path);
+  *slot = path.slot;
+  return path.block;
+}
+
+size_t lineOffset(int at){
+  int slot;
+  return lineBlockOf(at, &slot)->offset[slot];
+}
+
+size_t lineSize(int at){
+  int slot;
+  return lineBlockOf(at, &slot)->size[slot];
+}
+
+int lineIsDirty(int at){
+  int slot;
+  lineBlock *block = lineBlockOf(at, &slot);
+  return (block->dirty[slot / 64] >> (slot % 64)) & 1;
+}
+
+// Returns the text of a row, wherever it is stored.
+char *editRowChars(editRow *row){
+  return row->capacity <= ROW_INLINE_SIZE ? row->chars.inlined : row->chars.heap;
+}
+
+// Returns the text of a line, from its edited row if it has one.
+// Does not know about the active line, use lineGetText() to read any line.
+char *lineChars(int at){
+  int slot;
+  lineBlock *block = lineBlockOf(at, &slot);
+  if ((block->dirty[slot / 64] >> (slot % 64)) & 1) {
+    return editRowChars(&block->rows[slot]);
+  }
+  return E.text.data + block->offset[slot];
+}
+
+// Fills text with the current text of a line, including unflushed edits.
+void lineGetText(int at, struct lineText *text){
+  if (at == E.active.line) {
+    text->chars[0] = E.active.chars;
+    text->size[0] = E.active.gapStart;
+    text->chars[1] = E.active.chars + E.active.gapEnd;
+    text->size[1] = E.active.capacity - E.active.gapEnd;
+  } else {
+    text->chars[0] = lineChars(at);
+    text->size[0] = lineSize(at);
+    text->chars[1] = NULL;
+    text->size[1] = 0;
+  }
+}
+
+/*** edit log ***/
+
+// Records an edit of the document, which starts a new buffer version.
+void editLogEmit(int line, int col, int removed, int inserted, int lineDelta){
+  E.version++;
+  struct editRecord *rec = &E.edits.records[E.edits.head % EDIT_LOG_SIZE];
+  rec->version = E.version;
+  rec->line = line;
+  rec->col = col;
+  rec->removed = removed;
+  rec->inserted = inserted;
+  rec->lineDelta = lineDelta;
+  E.edits.head++;
+}
+
+/*
+Copies the record after *seen to rec and advances *seen. Returns 0 when there are no
+more records, and -1 when some were overwritten before the observer read them;
+*seen then skips to the latest record.
+*/
+int editLogRead(unsigned long *seen, struct editRecord *rec){
+  if (*seen == E.edits.head) return 0;
+  if (E.edits.head - *seen > EDIT_LOG_SIZE) {
+    *seen = E.edits.head;
+    return -1;
+  }
+  *rec = E.edits.records[*seen % EDIT_LOG_SIZE];
+  (*seen)++;
+  return 1;
+}
+
+/*** render cache ***/
+
+// Distance in lines from a line to the nearest line in the window, 0 when it is visible.
+int editorViewportDistance(int at){
+  if (at < E.rowOff) return E.rowOff - at;
+  if (at >= E.rowOff + E.screenRows) return at - (E.rowOff + E.screenRows - 1);
+  return 0;
+}
+
+// Drops the cached render text and highlighting of a line, after its text changed
+// or to reclaim memory.
+void lineInvalidateRender(int at){
+  int slot;
+  lineBlock *block = lineBlockOf(at, &slot);
+  struct renderCache *render = block->render[slot];
+  if (render == NULL) return;
+  E.clock.lines[render->clockSlot] = -1;
+  memFree(MEM_RENDER, render->chars, render->size + 1);
+  memFree(MEM_HIGHLIGHT, render->spans, sizeof(struct highlightSpan) * render->numSpans);
+  memFree(MEM_RENDER, render->visual, sizeof(struct visualCluster) * render->numVisual);
+  if (render->columns) {
+    memFree(MEM_RENDER, render->columns->points, sizeof(struct columnCheckpoint) * render->columns->capacity);
+    memFree(MEM_RENDER, render->columns, sizeof(struct columnIndex));
+  }
+  memFree(MEM_RENDER, render, sizeof(struct renderCache));
+  block->render[slot] = NULL;
+}
+
+/*
+Advances the clock hand to a slot that can take a new line, evicting the line in it.
+A free slot is taken as is. A line near the window is skipped, and a referenced line
+loses its reference bit and is skipped once. If a couple of full sweeps find nothing,
+which only happens when the cache is tiny compared to the screen, the line under the
+hand is evicted anyway.
+*/
+int renderClockEvict(){
+  struct renderClock *clock = &E.clock;
+  for (int step = 0; step < clock->capacity * 2; step++) {
+    int slot = clock->hand;
+    clock->hand = (clock->hand + 1) % clock->capacity;
+    int at = clock->lines[slot];
+    if (at == -1) return slot;
+    if (editorViewportDistance(at) <= E.screenRows) continue;
+    int atSlot;
+    struct renderCache *render = lineBlockOf(at, &atSlot)->render[atSlot];
+    if (render->referenced) {
+      render->referenced = 0;
+      continue;
+    }
+    lineInvalidateRender(at);
+    return slot;
+  }
+  int slot = clock->hand;
+  clock->hand = (clock->hand + 1) % clock->capacity;
+  if (clock->lines[slot] != -1) lineInvalidateRender(clock->lines[slot]);
+  return slot;
+}
+
+// Position in a line, as a byte index in the text, the matching position in the
+// render text, and the screen column.
+struct textWalk {
+  size_t byte;
+  size_t offset;
+  int column;
+};
+
+/*
+Returns the position after the cluster at w in the line text. Tabs advance to the
+next multiple of TAB_STOP, and become that many spaces in the render text.
+*/
+struct textWalk textWalkStep(struct textWalk w, const struct lineText *text){
+  if (textByte(text, w.byte) == '\t') {
+    int spaces = TAB_STOP - w.column % TAB_STOP;
+    return (struct textWalk){w.byte + 1, w.offset + spaces, w.column + spaces};
+  }
+  int width;
+  size_t next = textNextCluster(text, w.byte, &width);
+  return (struct textWalk){next, w.offset + next - w.byte, w.column + width};
+}
+
+// Advances w cluster by cluster over the line text until it reaches byte cx.
+// Walking backwards starts over from the start of the line.
+void textWalkTo(struct textWalk *w, const struct lineText *text, size_t cx){
+  if (cx < w->byte) memset(w, 0, sizeof(*w));
+  size_t size = text->size[0] + text->size[1];
+  size_t limit = cx < size ? cx : size;
+  while (w->byte < limit) {
+    // Printable ASCII followed by more ASCII is a cluster one column wide. The scan
+    // stays within one piece of the text, the step after it crosses the gap.
+    size_t j = w->byte;
+    int piece = j >= text->size[0];
+    size_t base = piece ? text->size[0] : 0;
+    size_t end = piece || limit < text->size[0] ? limit : text->size[0];
+    const unsigned char *chars = (const unsigned char *)text->chars[piece];
+    while (j + 1 < end && chars[j - base] >= 0x20 && chars[j - base] < 0x80 && chars[j + 1 - base] < 0x80) {
+      j++;
+    }
+    w->column += j - w->byte;
+    w->offset += j - w->byte;
+    w->byte = j;
+    *w = textWalkStep(*w, text);
+  }
+}
+
+/*
+Returns the last checkpoint of a long line at or before both byte and column, as a
+position to walk from. The checkpoints are extended up to there first if needed.
+*/
+struct textWalk columnIndexSeek(struct columnIndex *index, const struct lineText *text, size_t byte, int column){
+  if (index->count == 0) {
+    index->points = memAlloc(MEM_RENDER, sizeof(struct columnCheckpoint) * 16);
+    index->capacity = 16;
+    index->points[index->count++] = (struct columnCheckpoint){0, 0};
+  }
+  struct columnCheckpoint *last = &index->points[index->count - 1];
+  struct textWalk w = {last->byte, 0, last->column};
+  while (!index->complete && last->byte <= byte && last->column <= column) {
+    textWalkTo(&w, text, w.byte + COLUMN_CHECKPOINT_BYTES);
+    if (w.byte >= text->size[0] + text->size[1]) index->complete = 1;
+    if (index->count == index->capacity) {
+      index->points = memRealloc(MEM_RENDER, index->points, sizeof(struct columnCheckpoint) * index->capacity,
+                                 sizeof(struct columnCheckpoint) * index->capacity * 2);
+      index->capacity *= 2;
+    }
+    index->points[index->count++] = (struct columnCheckpoint){w.byte, w.column};
+    last = &index->points[index->count - 1];
+  }
+  int lo = 0, hi = index->count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (index->points[mid].byte <= byte && index->points[mid].column <= column) lo = mid; else hi = mid - 1;
+  }
+  return (struct textWalk){index->points[lo].byte, 0, index->points[lo].column};
+}
+
+// Drops the checkpoints of a long line at or after byte, after an edit there. The ones
+// before it stay valid, as the text before byte and its cluster boundaries did not change.
+void columnIndexTruncate(struct columnIndex *index, size_t byte){
+  while (index->count > 1 && index->points[index->count - 1].byte >= byte) index->count--;
+  index->complete = 0;
+}
+
+/*
+Computes the highlight spans of the render of a line, which holds the line text
+from start up to byte end: runs of digits, and the matches of the current search on
+top of them. Kinds are first marked per render byte, then runs of the same kind are
+merged into spans.
+*/
+void lineHighlight(int at, struct renderCache *render, const struct lineText *text,
+                   const struct textWalk *start, size_t end){
+  render->spans = NULL;
+  render->numSpans = 0;
+  if (render->size == 0) return;
+
+  unsigned char *hl = memAlloc(MEM_HIGHLIGHT, render->size);
+  for (size_t j = 0; j < render->size; j++) {
+    hl[j] = isdigit((unsigned char)render->chars[j]) ? HL_NUMBER : HL_NORMAL;
+  }
+  struct searchMatch *matches;
+  int numMatches = searchLineMatches(at, &matches);
+  // Matches are in order, skip the ones that end before the render starts.
+  int lo = 0, hi = numMatches;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((size_t)(matches[mid].col + E.search->patternLen) <= start->byte) lo = mid + 1; else hi = mid;
+  }
+  struct textWalk w = *start;
+  for (int i = lo; i < numMatches && (size_t)matches[i].col < end; i++) {
+    size_t col = matches[i].col;
+    // Overlapping matches walk again from the start of the render.
+    if (col < w.byte) w = *start;
+    textWalkTo(&w, text, col > start->byte ? col : start->byte);
+    size_t from = w.offset;
+    textWalkTo(&w, text, matches[i].col + E.search->patternLen);
+    for (size_t j = from; j < w.offset && j < render->size; j++) hl[j] = HL_MATCH;
+  }
+
+  int capacity = 0;
+  size_t j = 0;
+  while (j < render->size) {
+    if (hl[j] == HL_NORMAL) {
+      j++;
+      continue;
+    }
+    size_t start = j;
+    while (j < render->size && hl[j] == hl[start]) j++;
+    if (render->numSpans == capacity) {
+      int grown = capacity ? capacity * 2 : 4;
+      render->spans = memRealloc(MEM_HIGHLIGHT, render->spans,
+                                 sizeof(struct highlightSpan) * capacity, sizeof(struct highlightSpan) * grown);
+      capacity = grown;
+    }
+    struct highlightSpan *span = &render->spans[render->numSpans++];
+    span->start = start;
+    span->size = j - start;
+    span->hl = hl[start];
+  }
+  memFree(MEM_HIGHLIGHT, hl, render->size);
+  // Give back the unused tail, freeing counts the spans in use.
+  if (capacity > render->numSpans) {
+    render->spans = memRealloc(MEM_HIGHLIGHT, render->spans,
+                               sizeof(struct highlightSpan) * capacity, sizeof(struct highlightSpan) * render->numSpans);
+  }
+}
+
+/*
+Computes the display order of a line with right-to-left text, a simplified form of
+the Unicode bidirectional algorithm for a left-to-right paragraph:
+  - Right-to-left letters get level 1, left-to-right ones level 0.
+  - Numbers after right-to-left text get level 2, so they read left to right inside it.
+  - Neutrals between two runs going the same way take their level, other neutrals 0.
+Then from the highest level down, every run at that level or above is reversed.
+Explicit embeddings and mirrored brackets are not handled.
+*/
+void lineVisualOrder(struct renderCache *render){
+  render->visual = NULL;
+  render->numVisual = 0;
+  if (!bidiMayHaveRtl(render->chars, render->size)) return;
+
+  int count = 0;
+  for (size_t j = 0; j < render->size; count++) {
+    int width;
+    j = graphemeNext(render->chars, render->size, j, &width);
+  }
+  struct visualCluster *visual = memAlloc(MEM_RENDER, sizeof(struct visualCluster) * count);
+  unsigned char *types = memAlloc(MEM_RENDER, count * 2);
+  unsigned char *levels = types + count;
+  int rtl = 0, column = 0;
+  size_t j = 0;
+  for (int i = 0; i < count; i++) {
+    int width;
+    size_t next = graphemeNext(render->chars, render->size, j, &width);
+    uint32_t cp;
+    utf8Decode(render->chars + j, next - j, &cp);
+    visual[i] = (struct visualCluster){j, next - j, column, width};
+    types[i] = bidiTypeOf(cp);
+    if (types[i] == BIDI_R) rtl = 1;
+    column += width;
+    j = next;
+  }
+  if (!rtl) {
+    // The prefilter matched only digits or marks of a right-to-left block.
+    memFree(MEM_RENDER, visual, sizeof(struct visualCluster) * count);
+    memFree(MEM_RENDER, types, count * 2);
+    return;
+  }
+
+  // Strong types and numbers, the direction of the last strong type decides numbers.
+  int strong = BIDI_L;
+  for (int i = 0; i < count; i++) {
+    if (types[i] == BIDI_L || types[i] == BIDI_R) strong = types[i];
+    levels[i] = types[i] == BIDI_R ? 1 : types[i] == BIDI_NUMBER && strong == BIDI_R ? 2 : 0;
+  }
+  // Neutrals, numbers count as right-to-left on either side of them.
+  for (int i = 0; i < count;) {
+    if (types[i] != BIDI_NEUTRAL) {
+      i++;
+      continue;
+    }
+    int end = i;
+    while (end < count && types[end] == BIDI_NEUTRAL) end++;
+    int before = i > 0 ? levels[i - 1] > 0 : 0;
+    int after = end < count ? levels[end] > 0 : 0;
+    for (int k = i; k < end; k++) levels[k] = before && after ? 1 : 0;
+    i = end;
+  }
+  for (int level = 2; level >= 1; level--) {
+    for (int i = 0; i < count;) {
+      if (levels[i] < level) {
+        i++;
+        continue;
+      }
+      int end = i;
+      while (end < count && levels[end] >= level) end++;
+      for (int a = i, b = end - 1; a < b; a++, b--) {
+        struct visualCluster swap = visual[a];
+        visual[a] = visual[b];
+        visual[b] = swap;
+        unsigned char l = levels[a];
+        levels[a] = levels[b];
+        levels[b] = l;
+      }
+      i = end;
+    }
+  }
+  memFree(MEM_RENDER, types, count * 2);
+  render->visual = visual;
+  render->numVisual = count;
+}
+
+/*
+Returns the screen column at which the cluster at logical column rx of a line
+shows. Columns past the end of the line, and lines without right-to-left text,
+map to themselves.
+*/
+int lineVisualColumn(int at, int rx){
+  struct renderCache *render = lineRender(at);
+  int column = 0;
+  for (int i = 0; i < render->numVisual; i++) {
+    if (render->visual[i].column == rx) return column;
+    column += render->visual[i].width;
+  }
+  return rx;
+}
+
+/*
+Sets the render text to the line text between the positions from and to.
+Tabs are expanded to spaces up to the next multiple of TAB_STOP, counting columns
+by grapheme cluster so wide characters are taken into account.
+*/
+void renderSetText(struct renderCache *render, const struct lineText *text,
+                   struct textWalk from, const struct textWalk *to){
+  render->size = to->offset - from.offset;
+  render->chars = memAlloc(MEM_RENDER, render->size + 1);
+  char *dst = render->chars;
+  while (from.byte < to->byte) {
+    struct textWalk next = textWalkStep(from, text);
+    if (textByte(text, from.byte) == '\t') {
+      memset(dst, ' ', next.offset - from.offset);
+    } else {
+      textCopy(text, from.byte, next.byte, dst);
+    }
+    dst += next.offset - from.offset;
+    from = next;
+  }
+  *dst = '\0';
+}
+
+/*
+Renders the columns of a long line around the window, one screen on each side of
+it so scrolling a little does not render again. The column index finds where the
+slice starts without walking the line from its start.
+*/
+void lineRenderSlice(int at, struct renderCache *render, const struct lineText *text){
+  size_t size = text->size[0] + text->size[1];
+  int from = E.colOff > E.textColumns ? E.colOff - E.textColumns : 0;
+  int to = E.colOff + 2 * E.textColumns;
+  struct textWalk start = columnIndexSeek(render->columns, text, SIZE_MAX, from);
+  // Back to the start of the cluster holding column from.
+  while (start.byte < size) {
+    struct textWalk next = textWalkStep(start, text);
+    if (next.column > from) break;
+    start = next;
+  }
+  start.offset = 0;
+  struct textWalk end = start;
+  while (end.byte < size && end.column < to) end = textWalkStep(end, text);
+
+  renderSetText(render, text, start, &end);
+  lineHighlight(at, render, text, &start, end.byte);
+  render->visual = NULL;
+  render->numVisual = 0;
+  render->sliceStart = start.column;
+  render->sliceEnd = end.byte < size ? end.column : INT_MAX;
+}
+
+/*
+Returns the render text of a line, building and caching it on first use. Long lines
+only get the slice around the window, rendered again when the window scrolls past it.
+*/
+struct renderCache *lineRender(int at){
+  int slot;
+  lineBlock *block = lineBlockOf(at, &slot);
+  struct renderCache *render = block->render[slot];
+  if (render) {
+    render->referenced = 1;
+    if (render->columns == NULL ||
+        (E.colOff >= render->sliceStart && E.colOff + E.textColumns <= render->sliceEnd)) {
+      return render;
+    }
+    struct lineText text;
+    lineGetText(at, &text);
+    memFree(MEM_RENDER, render->chars, render->size + 1);
+    memFree(MEM_HIGHLIGHT, render->spans, sizeof(struct highlightSpan) * render->numSpans);
+    lineRenderSlice(at, render, &text);
+    render->stamp = ++E.renderStamp;
+    return render;
+  }
+
+  struct lineText text;
+  lineGetText(at, &text);
+  size_t size = text.size[0] + text.size[1];
+  render = memAlloc(MEM_RENDER, sizeof(struct renderCache));
+  render->columns = NULL;
+  if (size > LONG_LINE_SIZE) {
+    render->columns = memCalloc(MEM_RENDER, 1, sizeof(struct columnIndex));
+    lineRenderSlice(at, render, &text);
+  } else {
+    // Measure first so the render text is allocated at its exact size.
+    struct textWalk start = {0, 0, 0}, end = {0, 0, 0};
+    textWalkTo(&end, &text, size);
+    renderSetText(render, &text, start, &end);
+    lineHighlight(at, render, &text, &start, size);
+    lineVisualOrder(render);
+    render->sliceStart = 0;
+    render->sliceEnd = INT_MAX;
+  }
+
+  render->clockSlot = renderClockEvict();
+  render->referenced = 1;
+  render->stamp = ++E.renderStamp;
+  E.clock.lines[render->clockSlot] = at;
+  block->render[slot] = render;
+  return render;
+}
+
+// Drops every cached render, after something that affects all lines' highlighting changed.
+void renderCacheClear(){
+  for (int i = 0; i < E.clock.capacity; i++) {
+    if (E.clock.lines[i] != -1) lineInvalidateRender(E.clock.lines[i]);
+  }
+}
+
+// Finds the line of every cached render again, when the edits in between were lost.
+void renderClockRebuild(){
+  for (int i = 0; i < E.clock.capacity; i++) E.clock.lines[i] = -1;
+  for (int at = 0; at < E.index->numLines; at++) {
+    int slot;
+    struct renderCache *render = lineBlockOf(at, &slot)->render[slot];
+    if (render) E.clock.lines[render->clockSlot] = at;
+  }
+}
+
+/*
+Brings the line numbers in the clock up to date with the edit log. Caches move
+with their lines when lines are inserted or removed, only the numbers here are
+behind. Joined lines had their caches dropped when they were removed.
+*/
+void renderClockObserve(){
+  struct editRecord rec;
+  int r;
+  while ((r = editLogRead(&E.clock.seen, &rec)) > 0) {
+    if (rec.lineDelta == 0) continue;
+    int last = rec.line + (rec.lineDelta < 0 ? -rec.lineDelta : 0);
+    for (int i = 0; i < E.clock.capacity; i++) {
+      if (E.clock.lines[i] > last) E.clock.lines[i] += rec.lineDelta;
+    }
+  }
+  if (r < 0) renderClockRebuild();
+}
+
+/*
+Drops the cached highlighting of lines [first, end), after something affecting only
+those lines changed. Only lines with a render cache are looked at, by going through
+the clock. Long lines keep their column checkpoints, just their slice is rendered again.
+*/
+void renderCacheClearLines(int first, int end){
+  renderClockObserve();
+  for (int i = 0; i < E.clock.capacity; i++) {
+    int at = E.clock.lines[i];
+    if (at < first || at >= end) continue;
+    int slot;
+    struct renderCache *render = lineBlockOf(at, &slot)->render[slot];
+    if (render->columns) render->sliceEnd = render->sliceStart;
+    else lineInvalidateRender(at);
+  }
+}
+
+// Sets up an empty render cache. It always holds a few screens of lines.
+void renderClockInit(){
+  int capacity = RENDER_CACHE_LINES;
+  if (capacity < E.screenRows * 4) capacity = E.screenRows * 4;
+  E.clock.lines = memAlloc(MEM_RENDER, sizeof(int) * capacity);
+  for (int i = 0; i < capacity; i++) E.clock.lines[i] = -1;
+  E.clock.capacity = capacity;
+  E.clock.hand = 0;
+}
+
+/*** row operations ***/
+
+// Makes sure a row has room for at least capacity bytes, moving it to the heap if needed.
+void editRowReserve(editRow *row, size_t capacity){
+  if (capacity <= row->capacity) return;
+  if (capacity < (size_t)row->capacity * 2) capacity = (size_t)row->capacity * 2;
+  if (row->capacity <= ROW_INLINE_SIZE) {
+    char *heap = memAlloc(MEM_EDIT_ROWS, capacity);
+    // Copy out before writing heap, it shares storage with the inline text.
+    memcpy(heap, row->chars.inlined, row->size);
+    row->chars.heap = heap;
+  } else {
+    row->chars.heap = memRealloc(MEM_EDIT_ROWS, row->chars.heap, row->capacity, capacity);
+  }
+  row->capacity = capacity;
+}
+
+/*
+Returns the edited row of a line and marks the line dirty.
+A line that was not dirty yet gets an empty row; the caller fills in the text.
+*/
+editRow *lineEditRow(int at){
+  int slot;
+  lineBlock *block = lineBlockWritable(at, &slot);
+  if (block->rows == NULL) {
+    block->rows = memCalloc(MEM_EDIT_ROWS, LINE_BLOCK_SIZE, sizeof(editRow));
+  }
+  editRow *row = &block->rows[slot];
+  if ((block->dirty[slot / 64] >> (slot % 64)) & 1) return row;
+
+  row->size = 0;
+  row->capacity = ROW_INLINE_SIZE;
+  block->dirty[slot / 64] |= (uint64_t)1 << (slot % 64);
+  return row;
+}
+
+/*
+Records the new length of a line after an edit at byte col and drops its stale render
+text. A long line keeps the column checkpoints before col, so rendering it again walks
+on from the last of them rather than from the start of the line.
+*/
+void lineSetSize(int at, size_t size, size_t col){
+  int slot;
+  lineBlock *block = lineBlockWritable(at, &slot);
+  block->size[slot] = size;
+  struct renderCache *render = block->render[slot];
+  if (render == NULL || render->columns == NULL) {
+    lineInvalidateRender(at);
+    return;
+  }
+  columnIndexTruncate(render->columns, col);
+  // A slice that holds no column is rendered again on its next use.
+  render->sliceStart = INT_MAX;
+  render->sliceEnd = 0;
+}
+
+// Moves the lines in slots [from, from + count) of a block one slot up or down (delta 1 or -1).
+void lineBlockShift(lineBlock *block, int from, int count, int delta){
+  if (count <= 0) return;
+  int to = from + delta;
+  memmove(&block->offset[to], &block->offset[from], sizeof(size_t) * count);
+  memmove(&block->size[to], &block->size[from], sizeof(size_t) * count);
+  memmove(&block->render[to], &block->render[from], sizeof(struct renderCache *) * count);
+  memmove(&block->hlState[to], &block->hlState[from], count);
+  if (block->rows) memmove(&block->rows[to], &block->rows[from], sizeof(editRow) * count);
+  for (int i = 0; i < count; i++) {
+    int slot = delta > 0 ? from + count - 1 - i : from + i;
+    uint64_t bit = (block->dirty[slot / 64] >> (slot % 64)) & 1;
+    block->dirty[(slot + delta) / 64] &= ~((uint64_t)1 << ((slot + delta) % 64));
+    block->dirty[(slot + delta) / 64] |= bit << ((slot + delta) % 64);
+  }
+}
+
+// Copies everything about the line in slot from of src into slot to of dst.
+void lineSlotCopy(lineBlock *dst, int to, lineBlock *src, int from){
+  dst->offset[to] = src->offset[from];
+  dst->size[to] = src->size[from];
+  dst->render[to] = src->render[from];
+  dst->hlState[to] = src->hlState[from];
+  uint64_t bit = (src->dirty[from / 64] >> (from % 64)) & 1;
+  dst->dirty[to / 64] &= ~((uint64_t)1 << (to % 64));
+  dst->dirty[to / 64] |= bit << (to % 64);
+  if (bit) {
+    if (dst->rows == NULL) dst->rows = memCalloc(MEM_EDIT_ROWS, LINE_BLOCK_SIZE, sizeof(editRow));
+    dst->rows[to] = src->rows[from];
+  }
+}
+
+// Marks a slot as holding an empty, unedited line at text buffer position offset.
+void lineSlotClear(lineBlock *block, int slot, size_t offset){
+  block->offset[slot] = offset;
+  block->size[slot] = 0;
+  block->render[slot] = NULL;
+  block->hlState[slot] = 0;
+  block->dirty[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+// Returns the number of lines under a node.
+int lineNodeLines(struct lineNode *node){
+  int lines = 0;
+  for (int i = 0; i < node->count; i++) lines += node->lines[i];
+  return lines;
+}
+
+// Puts a new root above the old one, one level up in path.
+void lineIndexGrow(struct linePath *path){
+  if (E.index->height == LINE_INDEX_HEIGHT) die("lineIndexGrow - height");
+  struct lineNode *root = lineNodeAlloc();
+  root->children[0] = E.index->root;
+  root->lines[0] = E.index->numLines;
+  root->count = 1;
+  memmove(&path->nodes[1], &path->nodes[0], sizeof(struct lineNode *) * E.index->height);
+  memmove(&path->child[1], &path->child[0], sizeof(int) * E.index->height);
+  path->nodes[0] = root;
+  path->child[0] = 0;
+  E.index->root = root;
+  E.index->height++;
+}
+
+/*
+Puts child, with lines lines under it, at position i of the node at level of path.
+A full node is split in two and the new half goes into its parent the same way,
+up to a new root. The split is even, except when the child goes at the end: the node
+then stays full and the new half starts with the child alone, so a file read line by
+line leaves full nodes behind. The nodes of path must be writable.
+*/
+void lineNodeInsert(struct linePath *path, int level, int i, void *child, int lines){
+  struct lineNode *node = path->nodes[level];
+  struct lineNode *right = NULL;
+  int keep = 0;
+  if (node->count == LINE_NODE_SIZE) {
+    keep = i == node->count ? node->count : node->count / 2;
+    right = lineNodeAlloc();
+    right->count = node->count - keep;
+    memcpy(right->lines, &node->lines[keep], sizeof(int) * right->count);
+    memcpy(right->children, &node->children[keep], sizeof(void *) * right->count);
+    node->count = keep;
+  }
+  struct lineNode *into = node;
+  if (right && (i > keep || keep == LINE_NODE_SIZE)) {
+    into = right;
+    i -= keep;
+  }
+  memmove(&into->lines[i + 1], &into->lines[i], sizeof(int) * (into->count - i));
+  memmove(&into->children[i + 1], &into->children[i], sizeof(void *) * (into->count - i));
+  into->lines[i] = lines;
+  into->children[i] = child;
+  into->count++;
+  if (right == NULL) return;
+
+  if (level == 0) {
+    lineIndexGrow(path);
+    level++;
+  }
+  struct lineNode *parent = path->nodes[level - 1];
+  int at = path->child[level - 1];
+  parent->lines[at] = lineNodeLines(node);
+  lineNodeInsert(path, level - 1, at + 1, right, lineNodeLines(right));
+}
+
+/*
+Splits the full block at the end of path in two, like lineNodeInsert() splits nodes:
+evenly, or leaving it full when the new line goes after its last one.
+The nodes of path must be writable. Paths to lines are no longer valid afterwards.
+*/
+void lineBlockSplit(struct linePath *path){
+  lineBlock *block = path->block;
+  int keep = path->slot == block->count ? block->count : block->count / 2;
+  lineBlock *right = lineBlockAlloc();
+  for (int slot = keep; slot < block->count; slot++) {
+    lineSlotCopy(right, slot - keep, block, slot);
+    lineSlotClear(block, slot, 0);
+  }
+  right->count = block->count - keep;
+  block->count = keep;
+  int level = E.index->height - 1;
+  path->nodes[level]->lines[path->child[level]] = keep;
+  lineNodeInsert(path, level, path->child[level] + 1, right, right->count);
+}
+
+/*
+Takes the empty block at the end of path out of the tree, with the nodes it leaves
+empty, and drops a root that is left with a single child. The path must be writable,
+so everything taken out is the editor's own and is freed at once.
+*/
+void lineBlockDrop(struct linePath *path){
+  lineBlockFree(path->block);
+  for (int level = E.index->height - 1; level >= 0; level--) {
+    struct lineNode *node = path->nodes[level];
+    int i = path->child[level];
+    memmove(&node->lines[i], &node->lines[i + 1], sizeof(int) * (node->count - i - 1));
+    memmove(&node->children[i], &node->children[i + 1], sizeof(void *) * (node->count - i - 1));
+    node->count--;
+    if (node->count > 0) break;
+    lineNodeFree(node);
+  }
+  while (E.index->height > 1 && E.index->root->count == 1) {
+    struct lineNode *root = E.index->root;
+    E.index->root = root->children[0];
+    E.index->height--;
+    lineNodeFree(root);
+  }
+}
+
+/*
+Inserts an unedited line of size bytes at text buffer position offset before line at.
+Only the lines after it in its block move down one; a full block is split first.
+Render caches move with their lines; the clock catches up from the edit log.
+*/
+void lineIndexInsert(int at, size_t offset, size_t size){
+  struct linePath path;
+  lineIndexWritablePath(at, &path);
+  if (path.block->count == LINE_BLOCK_SIZE) {
+    lineBlockSplit(&path);
+    E.lineCache.valid = 0;
+    lineIndexWritablePath(at, &path);
+  }
+  lineBlock *block = path.block;
+  lineBlockShift(block, path.slot, block->count - path.slot, 1);
+  lineSlotClear(block, path.slot, offset);
+  block->size[path.slot] = size;
+  block->count++;
+  for (int level = 0; level < E.index->height; level++) path.nodes[level]->lines[path.child[level]]++;
+  E.index->numLines++;
+}
+
+// Appends a line to the end of the index. The line cache holds the last block while a
+// file is read, so this does not walk down the tree.
+void lineIndexAppend(size_t offset, size_t size){
+  lineIndexInsert(E.index->numLines, offset, size);
+}
+
+/*
+Removes line at, moving the lines after it in its block up one. The opposite of
+lineIndexInsert(). A block that becomes empty is dropped, unless it holds the last
+line of the document.
+*/
+void lineIndexRemove(int at){
+  lineInvalidateRender(at);
+  struct linePath path;
+  lineIndexWritablePath(at, &path);
+  lineBlock *block = path.block;
+  int slot = path.slot;
+  if (((block->dirty[slot / 64] >> (slot % 64)) & 1) && block->rows[slot].capacity > ROW_INLINE_SIZE) {
+    memFree(MEM_EDIT_ROWS, block->rows[slot].chars.heap, block->rows[slot].capacity);
+  }
+  lineBlockShift(block, slot + 1, block->count - slot - 1, -1);
+  // The old last slot now holds a stale copy of its line.
+  lineSlotClear(block, --block->count, 0);
+  for (int level = 0; level < E.index->height; level++) path.nodes[level]->lines[path.child[level]]--;
+  E.index->numLines--;
+  if (block->count == 0 && E.index->numLines > 0) {
+    lineBlockDrop(&path);
+    E.lineCache.valid = 0;
+  }
+}
+
+/*** active line ***/
+
+// Moves the gap so that it starts at pos, shifting the text in between across it.
+void gapBufferMoveGap(struct gapBuffer *gb, size_t pos){
+  if (pos < gb->gapStart) {
+    size_t count = gb->gapStart - pos;
+    memmove(gb->chars + gb->gapEnd - count, gb->chars + pos, count);
+    gb->gapStart -= count;
+    gb->gapEnd -= count;
+  } else if (pos > gb->gapStart) {
+    size_t count = pos - gb->gapStart;
+    memmove(gb->chars + gb->gapStart, gb->chars + gb->gapEnd, count);
+    gb->gapStart += count;
+    gb->gapEnd += count;
+  }
+}
+
+// Inserts a character at the start of the gap, doubling the buffer when the gap is used up.
+void gapBufferInsert(struct gapBuffer *gb, char c){
+  if (gb->gapStart == gb->gapEnd) {
+    size_t tail = gb->capacity - gb->gapEnd;
+    size_t capacity = gb->capacity ? gb->capacity * 2 : 64;
+    gb->chars = memRealloc(MEM_EDIT_ROWS, gb->chars, gb->capacity, capacity);
+    // Keep the text after the gap at the end of the buffer.
+    memmove(gb->chars + capacity - tail, gb->chars + gb->gapEnd, tail);
+    gb->gapEnd = capacity - tail;
+    gb->capacity = capacity;
+  }
+  gb->chars[gb->gapStart++] = c;
+}
+
+// Number of bytes of text in the gap buffer.
+size_t gapBufferLength(struct gapBuffer *gb){
+  return gb->capacity - (gb->gapEnd - gb->gapStart);
+}
+
+/*
+Writes the active line back into its edited row and releases it.
+Needs to run whenever the cursor leaves the line, and before anything reads lines
+without going through lineGetText().
+*/
+void editorFlushActiveLine(){
+  struct gapBuffer *gb = &E.active;
+  if (gb->line == -1) return;
+  size_t tail = gb->capacity - gb->gapEnd;
+  editRow *row = lineEditRow(gb->line);
+  // Nothing in the row is worth keeping, avoid copying it over when it grows.
+  row->size = 0;
+  editRowReserve(row, gb->gapStart + tail);
+  char *chars = editRowChars(row);
+  memcpy(chars, gb->chars, gb->gapStart);
+  memcpy(chars + gb->gapStart, gb->chars + gb->gapEnd, tail);
+  row->size = gb->gapStart + tail;
+  gb->line = -1;
+}
+
+// Loads a line into the gap buffer, flushing the line that was active before.
+void editorActivateLine(int at){
+  struct gapBuffer *gb = &E.active;
+  if (gb->line == at) return;
+  editorFlushActiveLine();
+
+  size_t size = lineSize(at);
+  // Leave room for some typing before the buffer has to grow.
+  size_t capacity = size + 64;
+  if (capacity > gb->capacity) {
+    gb->chars = memRealloc(MEM_EDIT_ROWS, gb->chars, gb->capacity, capacity);
+    gb->capacity = capacity;
+  }
+  memcpy(gb->chars, lineChars(at), size);
+  gb->gapStart = size;
+  gb->gapEnd = gb->capacity;
+  gb->line = at;
+}
+
+/*
+Returns the text of a line in one piece, for code that parses whole lines. The active
+line is copied out of its gap buffer, moving the gap would cost the next keystroke.
+*/
+const char *lineContiguous(int at, size_t *size){
+  if (at == E.active.line) {
+    struct gapBuffer *gb = &E.active;
+    *size = gapBufferLength(gb);
+    if (*size + 1 > gb->scratchCapacity) {
+      gb->scratch = memRealloc(MEM_EDIT_ROWS, gb->scratch, gb->scratchCapacity, *size + 1);
+      gb->scratchCapacity = *size + 1;
+    }
+    memcpy(gb->scratch, gb->chars, gb->gapStart);
+    memcpy(gb->scratch + gb->gapStart, gb->chars + gb->gapEnd, gb->capacity - gb->gapEnd);
+    return gb->scratch;
+  }
+  *size = lineSize(at);
+  return lineChars(at);
+}
+
+// Byte index of the start of the grapheme cluster after the one at cx, on line at.
+int lineNextCluster(int at, int cx){
+  struct lineText text;
+  lineGetText(at, &text);
+  int width;
+  return (size_t)cx < text.size[0] + text.size[1] ? (int)textNextCluster(&text, cx, &width) : cx;
+}
+
+// Byte index of the start of the grapheme cluster before cx, on line at.
+int linePrevCluster(int at, int cx){
+  struct lineText text;
+  lineGetText(at, &text);
+  return textPrevCluster(&text, cx);
+}
+
+// Byte index of the start of the grapheme cluster holding cx, on line at.
+int lineClusterStart(int at, int cx){
+  struct lineText text;
+  lineGetText(at, &text);
+  return textClusterStart(&text, cx);
+}
+
+/*** fenwick tree ***/
+
+/*
+Fenwick trees (binary indexed trees) of per-chunk counts. tree[i] holds the sum of
+the counts of chunks (i - (i & -i), i], for i from 1 to size, so adding to a chunk
+and summing a prefix both touch O(log size) entries.
+*/
+
+// Adds delta to the count of chunk i.
+void fenwickAdd(long *tree, int size, int i, long delta){
+  for (i++; i <= size; i += i & -i) tree[i] += delta;
+}
+
+// Returns the sum of the counts of chunks [0, i).
+long fenwickSum(const long *tree, int i){
+  long sum = 0;
+  for (; i > 0; i -= i & -i) sum += tree[i];
+  return sum;
+}
+
+// Returns the count of chunk i.
+long fenwickGet(const long *tree, int i){
+  return fenwickSum(tree, i + 1) - fenwickSum(tree, i);
+}
+
+/*
+Returns the chunk holding unit value of the counts, the first chunk whose prefix
+sum goes past value, or size when the counts add up to value or less. Walks down
+the tree from its largest power of two instead of binary searching prefix sums.
+*/
+int fenwickFind(const long *tree, int size, long value){
+  int pos = 0, step = 1;
+  while (step * 2 <= size) step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= size && tree[pos + step] <= value) {
+      pos += step;
+      value -= tree[pos];
+    }
+  }
+  return pos;
+}
+
+/*** search ***/
+
+// Chunk task of a search, on a worker thread.
+struct searchTask {
+  struct task task;
+  struct searchJob *job;
+  int chunk;
+  // Lines of the chunk in the snapshot, [firstLine, endLine).
+  int firstLine;
+  int endLine;
+  struct searchMatch *matches;
+  int count;
+  int capacity;
+};
+
+void searchJobRelease(struct searchJob *job){
+  if (--job->refs > 0) return;
+  for (int i = 0; i < job->numChunks; i++) {
+    memFree(MEM_SEARCH, job->chunks[i].matches, sizeof(struct searchMatch) * job->chunks[i].count);
+  }
+  memFree(MEM_SEARCH, job->chunks, sizeof(struct searchChunk) * job->numChunks);
+  memFree(MEM_SEARCH, job->counts, sizeof(long) * (job->numChunks + 1));
+  cancelTokenRelease(job->token);
+  if (job->snapshot) snapshotRelease(job->snapshot);
+  memFree(MEM_SEARCH, job->pattern, job->patternLen + 1);
+  memFree(MEM_SEARCH, job, sizeof(struct searchJob));
+}
+
+void searchTaskAddMatch(struct searchTask *st, int line, int col){
+  if (st->count == st->capacity) {
+    int capacity = st->capacity ? st->capacity * 2 : 64;
+    st->matches = memRealloc(MEM_SEARCH, st->matches,
+                             sizeof(struct searchMatch) * st->capacity, sizeof(struct searchMatch) * capacity);
+    st->capacity = capacity;
+  }
+  st->matches[st->count].line = line - st->firstLine;
+  st->matches[st->count].col = col;
+  st->count++;
+}
+
+/*
+Searches the lines of one chunk in the job's snapshot.
+Runs of unedited lines are contiguous in the text buffer, so they are searched with
+one memmem() over the whole run and the hits are mapped back to lines by walking the
+line offsets. Edited lines are searched one by one.
+Cancellation is checked about every SEARCH_STEP_SIZE bytes, so a stale search stops
+within microseconds instead of finishing its chunk.
+*/
+void searchTaskRun(struct task *task){
+  struct searchTask *st = (struct searchTask *)task;
+  struct searchJob *job = st->job;
+  struct lineIndex *snap = job->snapshot->index;
+  size_t scanned = 0;
+  int at = st->firstLine;
+  while (at < st->endLine) {
+    if (scanned >= SEARCH_STEP_SIZE) {
+      if (cancelTokenIsCancelled(job->token)) return;
+      scanned = 0;
+    }
+    int slot;
+    lineBlock *block = lineIndexFind(snap, at, &slot);
+    size_t size;
+    const char *chars = snapshotLineChars(snap, at, &size);
+
+    if ((block->dirty[slot / 64] >> (slot % 64)) & 1) {
+      const char *hit = chars;
+      while ((hit = memmem(hit, size - (hit - chars), job->pattern, job->patternLen)) != NULL) {
+        searchTaskAddMatch(st, at, hit - chars);
+        hit++;
+      }
+      scanned += size;
+      at++;
+      continue;
+    }
+
+    // Extend the run over the following unedited lines, up to a step worth of text.
+    int end = at + 1;
+    size_t runStart = block->offset[slot];
+    size_t runEnd = runStart + size;
+    lineBlock *next = block;
+    int nextSlot = slot + 1;
+    while (end < st->endLine && runEnd - runStart < SEARCH_STEP_SIZE) {
+      if (nextSlot == next->count) next = lineIndexFind(snap, end, &nextSlot);
+      if ((next->dirty[nextSlot / 64] >> (nextSlot % 64)) & 1) break;
+      runEnd = next->offset[nextSlot] + next->size[nextSlot];
+      end++;
+      nextSlot++;
+    }
+
+    // Hits are mapped to lines by walking the slots of the run, block by block.
+    int line = at;
+    lineBlock *lineIn = block;
+    int lineSlot = slot;
+    const char *hit = E.text.data + runStart;
+    while ((hit = memmem(hit, E.text.data + runEnd - hit, job->pattern, job->patternLen)) != NULL) {
+      size_t offset = hit - E.text.data;
+      while (line + 1 < end) {
+        int followingSlot = lineSlot + 1;
+        lineBlock *following = lineIn;
+        if (followingSlot == lineIn->count) following = lineIndexFind(snap, line + 1, &followingSlot);
+        if (following->offset[followingSlot] > offset) break;
+        lineIn = following;
+        lineSlot = followingSlot;
+        line++;
+      }
+      size_t lineStart = lineIn->offset[lineSlot];
+      size_t lineSize = lineIn->size[lineSlot];
+      // Hits across a line break are not matches.
+      if (offset + job->patternLen <= lineStart + lineSize) {
+        searchTaskAddMatch(st, line, offset - lineStart);
+      }
+      hit++;
+    }
+    scanned += runEnd - runStart;
+    at = end;
+  }
+}
+
+// Returns the chunk of a search that holds line at.
+int searchChunkOf(struct searchJob *job, int at){
+  int lo = 0, hi = job->numChunks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (job->chunks[mid].firstLine <= at) lo = mid; else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Searches the current text of a line again and puts its matches in its chunk.
+void searchRescanLine(struct searchJob *job, int at){
+  int c = searchChunkOf(job, at);
+  struct searchChunk *chunk = &job->chunks[c];
+  struct lineText text;
+  lineGetText(at, &text);
+  size_t size = text.size[0] + text.size[1];
+  char *chars = memAlloc(MEM_SEARCH, size + 1);
+  memcpy(chars, text.chars[0], text.size[0]);
+  if (text.size[1]) memcpy(chars + text.size[0], text.chars[1], text.size[1]);
+
+  // Matches of the line go after the ones of the lines above it.
+  int line = at - chunk->firstLine;
+  int pos = 0, hi = chunk->count;
+  while (pos < hi) {
+    int mid = (pos + hi) / 2;
+    if (chunk->matches[mid].line <= line) pos = mid + 1; else hi = mid;
+  }
+  const char *hit = chars;
+  while ((hit = memmem(hit, size - (hit - chars), job->pattern, job->patternLen)) != NULL) {
+    chunk->matches = memRealloc(MEM_SEARCH, chunk->matches, sizeof(struct searchMatch) * chunk->count,
+                                sizeof(struct searchMatch) * (chunk->count + 1));
+    memmove(&chunk->matches[pos + 1], &chunk->matches[pos], sizeof(struct searchMatch) * (chunk->count - pos));
+    chunk->matches[pos].line = line;
+    chunk->matches[pos].col = hit - chars;
+    chunk->count++;
+    fenwickAdd(job->counts, job->numChunks, c, 1);
+    pos++;
+    hit++;
+  }
+  memFree(MEM_SEARCH, chars, size + 1);
+  lineInvalidateRender(at);
+}
+
+// Returns where a chunk bound below an edit record moves to.
+int searchMoveBound(int bound, struct editRecord *rec){
+  if (bound <= rec->line) return bound;
+  return bound + rec->lineDelta > rec->line ? bound + rec->lineDelta : rec->line + 1;
+}
+
+/*
+Applies one edit record to the matches of a chunk starting at line first: matches
+on the edited lines are dropped, and the ones below move with their lines. Returns
+the number kept, which count from the moved first line.
+*/
+int searchDropEdited(struct searchMatch *list, int count, int first, struct editRecord *rec){
+  int last = rec->line + (rec->lineDelta < 0 ? -rec->lineDelta : 0);
+  int moved = searchMoveBound(first, rec);
+  int kept = 0;
+  for (int i = 0; i < count; i++) {
+    struct searchMatch m = list[i];
+    int line = first + m.line;
+    if (line >= rec->line && line <= last) continue;
+    if (line > last) line += rec->lineDelta;
+    m.line = line - moved;
+    list[kept++] = m;
+  }
+  return kept;
+}
+
+/*
+Adds the lines an edit record changed to the lines to search again, moving the
+ones already there with the edit. Returns 0 when they do not all fit.
+*/
+int searchRescanAdd(int *rescan, int *numRescan, struct editRecord *rec){
+  int last = rec->line + (rec->lineDelta < 0 ? -rec->lineDelta : 0);
+  for (int i = 0; i < *numRescan; i++) {
+    if (rescan[i] > last) rescan[i] += rec->lineDelta;
+    else if (rescan[i] > rec->line) rescan[i] = rec->line;
+  }
+  int added = rec->lineDelta > 0 ? rec->lineDelta : 0;
+  for (int l = rec->line; l <= rec->line + added; l++) {
+    if (*numRescan == SEARCH_RESCAN_LINES) return 0;
+    rescan[(*numRescan)++] = l;
+  }
+  return 1;
+}
+
+int searchLineCompare(const void *a, const void *b){
+  return *(const int *)a - *(const int *)b;
+}
+
+// Searches the lines of rescan again, skipping the ones of chunks a task still has to search.
+void searchRescanLines(struct searchJob *job, int *rescan, int numRescan){
+  qsort(rescan, numRescan, sizeof(int), searchLineCompare);
+  for (int i = 0; i < numRescan; i++) {
+    if (i > 0 && rescan[i] == rescan[i - 1]) continue;
+    if (rescan[i] >= E.index->numLines) continue;
+    struct searchChunk *chunk = &job->chunks[searchChunkOf(job, rescan[i])];
+    if (!chunk->pending && !chunk->stale && !chunk->dropped) searchRescanLine(job, rescan[i]);
+  }
+}
+
+/*
+Hands the matches of a chunk over to the job, on the main thread. The matches were
+found in the pass's snapshot, so the edits made since are applied to them from the
+edit log, and the lines they changed are searched again. When the log no longer
+holds all of those edits the chunk is searched again in the next pass.
+*/
+void searchTaskComplete(struct task *task){
+  struct searchTask *st = (struct searchTask *)task;
+  struct searchJob *job = st->job;
+  struct searchChunk *chunk = &job->chunks[st->chunk];
+  // Edits the search has not seen yet are applied to the other chunks first, so
+  // the replay below brings these matches to the same point.
+  if (job == E.search) searchObserve();
+  chunk->pending = 0;
+  if (job == E.search && !cancelTokenIsCancelled(job->token)) {
+    int rescan[SEARCH_RESCAN_LINES];
+    int numRescan = 0, complete = E.edits.head - job->passHead <= EDIT_LOG_SIZE;
+    unsigned long seen = job->passHead;
+    int first = st->firstLine;
+    struct editRecord rec;
+    while (complete && editLogRead(&seen, &rec) > 0) {
+      if (st->endLine > rec.line) st->count = searchDropEdited(st->matches, st->count, first, &rec);
+      first = searchMoveBound(first, &rec);
+      st->endLine = searchMoveBound(st->endLine, &rec);
+      complete = searchRescanAdd(rescan, &numRescan, &rec);
+    }
+    if (complete) {
+      memFree(MEM_SEARCH, chunk->matches, sizeof(struct searchMatch) * chunk->count);
+      chunk->matches = memRealloc(MEM_SEARCH, st->matches,
+                                  sizeof(struct searchMatch) * st->capacity, sizeof(struct searchMatch) * st->count);
+      fenwickAdd(job->counts, job->numChunks, st->chunk, st->count - chunk->count);
+      chunk->count = st->count;
+      st->matches = NULL;
+      st->capacity = 0;
+      // Edited lines of the other chunks were searched again when the edits were observed.
+      int kept = 0;
+      for (int i = 0; i < numRescan; i++) {
+        if (rescan[i] < E.index->numLines && searchChunkOf(job, rescan[i]) == st->chunk) rescan[kept++] = rescan[i];
+      }
+      searchRescanLines(job, rescan, kept);
+      // Lines of the chunk that were drawn without these matches need to be highlighted again.
+      if (chunk->count) renderCacheClearLines(chunk->firstLine, chunk->endLine);
+    } else {
+      chunk->stale = 1;
+    }
+  }
+  // The snapshot is only needed while chunks are searched, later edits are applied
+  // to the matches directly.
+  if (--job->remaining == 0) {
+    snapshotRelease(job->snapshot);
+    job->snapshot = NULL;
+    if (job == E.search) searchPass(job);
+  }
+  memFree(MEM_SEARCH, st->matches, sizeof(struct searchMatch) * st->capacity);
+  memFree(MEM_SEARCH, st, sizeof(struct searchTask));
+  searchJobRelease(job);
+}
+
+// Cancels the current search and stops highlighting its matches.
+void editorSearchStop(){
+  if (E.search == NULL) return;
+  cancelTokenCancel(E.search->token);
+  searchJobRelease(E.search);
+  E.search = NULL;
+  renderCacheClear();
+}
+
+// Queues a task searching one chunk of a job in the snapshot of its pass.
+void searchSubmit(struct searchJob *job, int c){
+  struct searchChunk *chunk = &job->chunks[c];
+  struct searchTask *st = memCalloc(MEM_SEARCH, 1, sizeof(struct searchTask));
+  st->task.run = searchTaskRun;
+  st->task.complete = searchTaskComplete;
+  st->job = job;
+  st->chunk = c;
+  st->firstLine = chunk->firstLine;
+  st->endLine = chunk->endLine;
+  chunk->pending = 1;
+  job->refs++;
+  job->remaining++;
+  // Chunks on the screen first, so visible matches show up before the rest.
+  int visible = E.rowOff < chunk->endLine && E.rowOff + E.screenRows >= chunk->firstLine;
+  taskSubmit(&st->task, job->token, visible ? TASK_VIEWPORT : TASK_BACKGROUND);
+}
+
+/*
+Searches the stale chunks of a job again, on a new snapshot. Only runs once the
+previous pass is done, so a long search takes one snapshot per pass rather than
+one per key typed.
+*/
+void searchPass(struct searchJob *job){
+  int stale = 0;
+  for (int c = 0; c < job->numChunks; c++) stale |= job->chunks[c].stale;
+  if (!stale) return;
+  job->snapshot = editorSnapshot();
+  job->passHead = E.edits.head;
+  for (int c = 0; c < job->numChunks; c++) {
+    if (!job->chunks[c].stale) continue;
+    job->chunks[c].stale = 0;
+    job->chunks[c].dropped = 0;
+    searchSubmit(job, c);
+  }
+}
+
+/*
+Starts searching for pattern in a snapshot of the current buffer version,
+cancelling the search that was running. Chunks are cut at line starts found by a
+binary search over line offsets.
+*/
+void editorSearchStart(const char *pattern){
+  editorSearchStop();
+
+  struct searchJob *job = memCalloc(MEM_SEARCH, 1, sizeof(struct searchJob));
+  job->patternLen = strlen(pattern);
+  job->pattern = memAlloc(MEM_SEARCH, job->patternLen + 1);
+  memcpy(job->pattern, pattern, job->patternLen + 1);
+  job->snapshot = editorSnapshot();
+  job->passHead = E.edits.head;
+  job->token = cancelTokenNew(MEM_SEARCH);
+  job->refs = 1;
+  job->seen = E.edits.head;
+  E.search = job;
+
+  struct lineIndex *snap = job->snapshot->index;
+  int capacity = E.text.size / SEARCH_CHUNK_SIZE + 1;
+  job->chunks = memCalloc(MEM_SEARCH, capacity, sizeof(struct searchChunk));
+  int first = 0;
+  for (int i = 1; i <= capacity && first < snap->numLines; i++) {
+    int end = i == capacity ? snap->numLines : snapshotLineAtOffset(snap, i * SEARCH_CHUNK_SIZE);
+    if (end <= first) continue;
+    job->chunks[job->numChunks].firstLine = first;
+    job->chunks[job->numChunks].endLine = end;
+    job->numChunks++;
+    first = end;
+  }
+  // An empty buffer still gets a chunk, for the lines typed into it.
+  if (job->numChunks == 0) job->numChunks = 1;
+  // Long lines can leave some of the estimated chunks unused, only the used ones are kept.
+  job->chunks = memRealloc(MEM_SEARCH, job->chunks, sizeof(struct searchChunk) * capacity,
+                           sizeof(struct searchChunk) * job->numChunks);
+  job->counts = memCalloc(MEM_SEARCH, job->numChunks + 1, sizeof(long));
+  for (int c = 0; c < job->numChunks; c++) searchSubmit(job, c);
+  renderCacheClear();
+}
+
+/*
+Points matches at the matches of the current search on a line and returns their
+number.
+*/
+int searchLineMatches(int at, struct searchMatch **matches){
+  struct searchJob *job = E.search;
+  if (job == NULL || job->numChunks == 0) return 0;
+  struct searchChunk *chunk = &job->chunks[searchChunkOf(job, at)];
+  struct searchMatch *list = chunk->matches;
+  int count = chunk->count;
+  at -= chunk->firstLine;
+  // First match on or after the line, then all the ones on it.
+  int lo = 0, hi = count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (list[mid].line < at) lo = mid + 1; else hi = mid;
+  }
+  int end = lo;
+  while (end < count && list[end].line == at) end++;
+  *matches = list + lo;
+  return end - lo;
+}
+
+/*
+Returns the number of matches of the current search on the lines before at: the
+matches of the chunks above from the Fenwick tree, and the ones of its own chunk
+from a binary search.
+*/
+long searchMatchesBefore(int at){
+  struct searchJob *job = E.search;
+  if (job == NULL || job->numChunks == 0) return 0;
+  int c = searchChunkOf(job, at);
+  struct searchChunk *chunk = &job->chunks[c];
+  int lo = 0, hi = chunk->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (chunk->matches[mid].line < at - chunk->firstLine) lo = mid + 1; else hi = mid;
+  }
+  return fenwickSum(job->counts, c) + lo;
+}
+
+// Orders search matches by position.
+int searchMatchCompare(const struct searchMatch *a, int line, int col){
+  if (a->line != line) return a->line < line ? -1 : 1;
+  if (a->col != col) return a->col < col ? -1 : 1;
+  return 0;
+}
+
+/*
+Finds the first match after (or with a negative direction, before) the given
+position, looking through the chunks found so far. Returns 0 when there is none.
+The rank of the position among the matches comes from the Fenwick tree and a binary
+search in its chunk, and the match next to it is found by rank the same way.
+*/
+int searchFindNext(int line, int col, int direction, struct searchMatch *found){
+  struct searchJob *job = E.search;
+  if (job == NULL || job->numChunks == 0) return 0;
+  int c = searchChunkOf(job, line);
+  struct searchChunk *chunk = &job->chunks[c];
+  // Matches of the chunk before the position, or up to it when moving forward.
+  int lo = 0, hi = chunk->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = searchMatchCompare(&chunk->matches[mid], line - chunk->firstLine, col);
+    if (cmp < 0 || (cmp == 0 && direction > 0)) lo = mid + 1; else hi = mid;
+  }
+  long rank = fenwickSum(job->counts, c) + lo;
+  if (direction < 0) rank--;
+  if (rank < 0 || rank >= fenwickSum(job->counts, job->numChunks)) return 0;
+
+  c = fenwickFind(job->counts, job->numChunks, rank);
+  chunk = &job->chunks[c];
+  struct searchMatch *m = &chunk->matches[rank - fenwickSum(job->counts, c)];
+  found->line = chunk->firstLine + m->line;
+  found->col = m->col;
+  return 1;
+}
+
+/*
+Applies one edit record to the chunks of a search: their matches and bounds move
+with the lines, and the edited lines are added to rescan. When rescan is full, the
+chunk of the edit is searched again in the next pass instead.
+*/
+void searchApplyEdit(struct searchJob *job, struct editRecord *rec, int *rescan, int *numRescan){
+  int last = rec->line + (rec->lineDelta < 0 ? -rec->lineDelta : 0);
+  for (int c = 0; c < job->numChunks; c++) {
+    struct searchChunk *chunk = &job->chunks[c];
+    if (chunk->endLine <= rec->line) continue;
+    // Chunks below the edited lines keep their matches as they are.
+    int kept = chunk->firstLine > last ? chunk->count : searchDropEdited(chunk->matches, chunk->count, chunk->firstLine, rec);
+    if (kept < chunk->count) {
+      fenwickAdd(job->counts, job->numChunks, c, kept - chunk->count);
+      chunk->matches = memRealloc(MEM_SEARCH, chunk->matches, sizeof(struct searchMatch) * chunk->count,
+                                  sizeof(struct searchMatch) * kept);
+      chunk->count = kept;
+    }
+    chunk->firstLine = searchMoveBound(chunk->firstLine, rec);
+    chunk->endLine = searchMoveBound(chunk->endLine, rec);
+  }
+  if (!searchRescanAdd(rescan, numRescan, rec)) job->chunks[searchChunkOf(job, rec->line)].stale = 1;
+}
+
+/*
+Brings the current search up to date with the edit log. Only the edited lines are
+searched again, also while the search is still running: edits to chunks that a task
+is still searching are applied when its results come back. Chunks that cannot be
+updated line by line are searched again in a background pass.
+*/
+void searchObserve(){
+  struct searchJob *job = E.search;
+  if (job == NULL || job->seen == E.edits.head) return;
+  int rescan[SEARCH_RESCAN_LINES];
+  int numRescan = 0;
+  struct editRecord rec;
+  int r;
+  while ((r = editLogRead(&job->seen, &rec)) > 0) searchApplyEdit(job, &rec, rescan, &numRescan);
+  if (r < 0) {
+    // Fell behind the log, every chunk is searched again.
+    for (int c = 0; c < job->numChunks; c++) job->chunks[c].stale = 1;
+  }
+  job->chunks[job->numChunks - 1].endLine = E.index->numLines;
+  searchRescanLines(job, rescan, numRescan);
+  if (job->remaining == 0) searchPass(job);
+}
+
+// Returns 1 when a chunk holds lines on the screen or within a screen of it.
+int searchChunkNearScreen(struct searchChunk *chunk){
+  return chunk->endLine > E.rowOff - E.screenRows && chunk->firstLine < E.rowOff + 2 * E.screenRows;
+}
+
+/*
+Gives back the matches of chunks away from the screen until memory use is under
+the budget. Finding the next match skips them until the chunk is searched again.
+*/
+void searchShrink(){
+  struct searchJob *job = E.search;
+  if (job == NULL) return;
+  for (int c = 0; c < job->numChunks && memTotal() > E.memBudget; c++) {
+    struct searchChunk *chunk = &job->chunks[c];
+    if (chunk->count == 0 || chunk->pending || chunk->stale || searchChunkNearScreen(chunk)) continue;
+    memFree(MEM_SEARCH, chunk->matches, sizeof(struct searchMatch) * chunk->count);
+    chunk->matches = NULL;
+    fenwickAdd(job->counts, job->numChunks, c, -chunk->count);
+    chunk->count = 0;
+    chunk->dropped = 1;
+  }
+}
+
+// Searches the dropped chunks that came near the screen again.
+void searchReload(){
+  struct searchJob *job = E.search;
+  if (job == NULL) return;
+  int reload = 0;
+  for (int c = 0; c < job->numChunks; c++) {
+    struct searchChunk *chunk = &job->chunks[c];
+    if (!chunk->dropped || !searchChunkNearScreen(chunk)) continue;
+    chunk->dropped = 0;
+    chunk->stale = 1;
+    reload = 1;
+  }
+  if (reload && job->remaining == 0) searchPass(job);
+}
+
+/*** time index ***/
+
+// Reads the n digits at s into *value. Returns 0 when they are not all digits.
+int timeDigits(const char *s, int n, int *value){
+  *value = 0;
+  for (int i = 0; i < n; i++) {
+    if (!isdigit((unsigned char)s[i])) return 0;
+    *value = *value * 10 + (s[i] - '0');
+  }
+  return 1;
+}
+
+// Seconds from a HH:MM:SS time of day at s, or -1.
+long long timeOfDay(const char *s, size_t len){
+  int h, m, sec;
+  if (len < 8 || s[2] != ':' || s[5] != ':') return -1;
+  if (!timeDigits(s, 2, &h) || !timeDigits(s + 3, 2, &m) || !timeDigits(s + 6, 2, &sec)) return -1;
+  if (h > 23 || m > 59 || sec > 60) return -1;
+  return h * 3600 + m * 60 + sec;
+}
+
+// Days from 1970-01-01 to a date of the proleptic Gregorian calendar.
+long long timeDaysFromCivil(int y, int m, int d){
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (long long)era * 146097 + doe - 719468;
+}
+
+/*
+Parses the timestamp at the start of a line, after an optional [ or spaces, in the
+given format. Returns it as seconds that sort like the timestamps do: days times
+86400 plus the time of day, so the time of day is the remainder. -1 when the line
+does not start with a timestamp. Fractions of seconds and time zones are ignored.
+*/
+long long timeParse(const char *s, size_t len, enum timeFormat format){
+  size_t skip = 0;
+  while (skip < len && skip < 4 && (s[skip] == '[' || s[skip] == ' ')) skip++;
+  s += skip;
+  len -= skip;
+  switch (format) {
+    case TIME_ISO:
+      {
+        // 2024-01-31T14:32:05 or with a space in place of the T.
+        int y, m, d;
+        if (len < 19 || s[4] != '-' || s[7] != '-' || (s[10] != 'T' && s[10] != ' ')) return -1;
+        if (!timeDigits(s, 4, &y) || !timeDigits(s + 5, 2, &m) || !timeDigits(s + 8, 2, &d)) return -1;
+        if (m < 1 || m > 12 || d < 1 || d > 31) return -1;
+        long long t = timeOfDay(s + 11, len - 11);
+        return t < 0 ? -1 : timeDaysFromCivil(y, m, d) * 86400 + t;
+      }
+    case TIME_SYSLOG:
+      {
+        // Jan 31 14:32:05, with the day padded by a space below 10.
+        static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        if (len < 15 || s[3] != ' ' || s[6] != ' ') return -1;
+        int month = 0;
+        while (month < 12 && strncmp(months + month * 3, s, 3) != 0) month++;
+        int d;
+        if (month == 12) return -1;
+        if (s[4] == ' ' ? !timeDigits(s + 5, 1, &d) : !timeDigits(s + 4, 2, &d)) return -1;
+        long long t = timeOfDay(s + 7, len - 7);
+        return t < 0 ? -1 : (long long)(month * 32 + d) * 86400 + t;
+      }
+    case TIME_CLOCK:
+      return timeOfDay(s, len);
+    default:
+      return -1;
+  }
+}
+
+// Counts a line in counts[format] for every timestamp format it starts with.
+void timeDetectLine(const char *s, size_t len, int *counts){
+  for (int format = TIME_ISO; format <= TIME_CLOCK; format++) {
+    if (timeParse(s, len, format) >= 0) counts[format]++;
+  }
+}
+
+// Returns the format the most lines counted by timeDetectLine() start with, the
+// first one on a tie. TIME_NONE when no line starts with a timestamp.
+enum timeFormat timeDetectBest(const int *counts){
+  int best = TIME_NONE;
+  for (int format = TIME_ISO; format <= TIME_CLOCK; format++) {
+    if (counts[format] > counts[best]) best = format;
+  }
+  return best;
+}
+
+/*
+Finds which timestamp format the lines of the file start with, by trying every
+format on the first TIME_DETECT_LINES lines and keeping the one that parses most.
+*/
+enum timeFormat timeDetect(){
+  int counts[TIME_CLOCK + 1] = {0};
+  for (int at = 0; at < E.index->numLines && at < TIME_DETECT_LINES; at++) {
+    size_t size;
+    const char *chars = lineContiguous(at, &size);
+    timeDetectLine(chars, size, counts);
+  }
+  return timeDetectBest(counts);
+}
+
+/*
+Parses the argument of the time command: HH:MM:SS on the day of timestamp here, or a
+full YYYY-MM-DD HH:MM:SS for ISO timestamps. A time of day is taken alone when here
+is -1. Returns -1 when the argument is neither.
+*/
+long long timeArgument(const char *arg, enum timeFormat format, long long here){
+  long long time = format == TIME_ISO ? timeParse(arg, strlen(arg), TIME_ISO) : -1;
+  if (time >= 0) return time;
+  time = timeOfDay(arg, strlen(arg));
+  if (time >= 0 && here >= 0) time += here - here % 86400;
+  return time;
+}
+
+/*
+Returns the timestamp of a line. Lines without one, like the rest of a stack trace,
+take the timestamp of the next line that has one within TIME_SCAN_LINES lines, so a
+search lands on that entry. Lines further from it, in a long run of them, take the
+timestamp of the entry above, looked for back to line from; before is the timestamp
+of line from, for when there is none in between, and -1 at the start of the file.
+Either way timestamps never decrease along a sorted log.
+*/
+long long timeAt(int at, int from, long long before){
+  for (int line = at, end = at + TIME_SCAN_LINES; line < E.index->numLines && line < end; line++) {
+    size_t size;
+    const char *chars = lineContiguous(line, &size);
+    long long t = timeParse(chars, size, E.times.format);
+    if (t >= 0) return t;
+  }
+  for (int line = at - 1; line > from; line--) {
+    size_t size;
+    const char *chars = lineContiguous(line, &size);
+    long long t = timeParse(chars, size, E.times.format);
+    if (t >= 0) return t;
+  }
+  return before;
+}
+
+/*
+Builds the time index when it is missing or older than the text: the format, and
+the timestamp of every TIME_INDEX_STEP-th line. A few thousand lines are parsed even
+for a file of millions of lines.
+*/
+void timeIndexUpdate(){
+  struct timeIndex *index = &E.times;
+  if (index->samples && index->version == E.version) return;
+  memFree(MEM_TIME, index->samples, sizeof(struct timeSample) * index->count);
+  index->format = timeDetect();
+  index->count = (E.index->numLines + TIME_INDEX_STEP - 1) / TIME_INDEX_STEP;
+  index->samples = memAlloc(MEM_TIME, sizeof(struct timeSample) * (index->count + 1));
+  for (int i = 0; i < index->count; i++) {
+    index->samples[i].line = i * TIME_INDEX_STEP;
+    index->samples[i].time = i == 0 ? timeAt(0, 0, -1) :
+      timeAt(i * TIME_INDEX_STEP, index->samples[i - 1].line, index->samples[i - 1].time);
+  }
+  // The end of the file closes the last range of lines.
+  index->samples[index->count] = (struct timeSample){LLONG_MAX, E.index->numLines};
+  index->count++;
+  index->version = E.version;
+}
+
+// Returns the timestamp of a line as timeAt() does, from the sample above it.
+long long timeLine(int at){
+  timeIndexUpdate();
+  struct timeSample *from = &E.times.samples[at / TIME_INDEX_STEP];
+  return timeAt(at, from->line, from->time);
+}
+
+/*
+Returns the first line whose timestamp is at or after time, or the number of lines
+when there is none. A binary search over the samples picks the range between two of
+them, and a binary search over the lines of that range finishes it.
+*/
+int timeFind(long long time){
+  timeIndexUpdate();
+  struct timeIndex *index = &E.times;
+  int lo = 0, hi = index->count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (index->samples[mid].time < time) lo = mid + 1; else hi = mid;
+  }
+  if (lo == 0) return 0;
+  struct timeSample *from = &index->samples[lo - 1];
+  int first = from->line, last = index->samples[lo].line;
+  while (first < last) {
+    int mid = first + (last - first) / 2;
+    if (timeAt(mid, from->line, from->time) < time) first = mid + 1; else last = mid;
+  }
+  // Lines without a timestamp belong to the entry above them, land on the next entry.
+  for (int end = first + TIME_SCAN_LINES; first < E.index->numLines && first < end; first++) {
+    size_t size;
+    const char *chars = lineContiguous(first, &size);
+    if (timeParse(chars, size, index->format) >= 0) break;
+  }
+  return first;
+}
+
+/*** merge view ***/
+
+// Offset of the end of the line starting at off, its newline or the end of the file.
+size_t mergeLineEnd(const struct mergeSource *src, size_t off){
+  const char *newline = memchr(src->data + off, '\n', src->size - off);
+  return newline ? (size_t)(newline - src->data) : src->size;
+}
+
+// Offset of the start of the line before the one starting at off, which is not 0.
+size_t mergeLineStart(const struct mergeSource *src, size_t off){
+  if (off < 2) return 0;
+  const char *newline = memrchr(src->data, '\n', off - 1);
+  return newline ? (size_t)(newline - src->data) + 1 : 0;
+}
+
+// Timestamp of the line starting at off, or -1 when it has none.
+long long mergeLineTime(const struct mergeSource *src, size_t off){
+  return timeParse(src->data + off, mergeLineEnd(src, off) - off, src->format);
+}
+
+/*
+Returns the timestamp a line sorts by. Lines without one, like the rest of a stack
+trace, follow the entry above them, however far up it is: it is looked for back to
+the start of the line's MERGE_SAMPLE_BYTES block, and above that the block's key is
+taken. Lines before any entry sort first. Keys never decrease along a file.
+*/
+long long mergeLineKey(struct mergeSource *src, size_t off){
+  size_t block = off / MERGE_SAMPLE_BYTES;
+  for (;;) {
+    long long t = mergeLineTime(src, off);
+    if (t >= 0) return t;
+    if (off == 0) return LLONG_MIN;
+    size_t start = mergeLineStart(src, off);
+    if (start < block * MERGE_SAMPLE_BYTES) break;
+    off = start;
+  }
+  return mergeBlockKey(src, block);
+}
+
+// Returns the key of the last line starting before a block, found on first use.
+long long mergeBlockKey(struct mergeSource *src, size_t block){
+  if (block == 0) return LLONG_MIN;
+  if (src->keys[block] == LLONG_MAX) {
+    src->keys[block] = mergeLineKey(src, mergeLineStart(src, block * MERGE_SAMPLE_BYTES));
+  }
+  return src->keys[block];
+}
+
+// Returns the key of the line before the one starting at off, which sorts by key.
+long long mergeKeyBefore(struct mergeSource *src, size_t off, long long key){
+  if (off == 0) return LLONG_MIN;
+  // The line before one without a timestamp is in the same entry.
+  if (off < src->size && mergeLineTime(src, off) < 0) return key;
+  return mergeLineKey(src, mergeLineStart(src, off));
+}
+
+// Puts file f of position p at the line starting at off.
+void mergeSeek(struct mergePosition *p, int f, size_t off){
+  struct mergeSource *src = &E.merge.sources[f];
+  p->offsets[f] = off;
+  p->keys[f] = off < src->size ? mergeLineKey(src, off) : LLONG_MAX;
+  p->before[f] = mergeKeyBefore(src, off, p->keys[f]);
+}
+
+/*
+Returns the file whose line comes next at position p of the merge: the one with the
+earliest line, the first file on a tie. -1 when every file is at its end.
+*/
+int mergePeek(const struct mergePosition *p){
+  int best = -1;
+  for (int f = 0; f < E.merge.numSources; f++) {
+    if (p->offsets[f] >= E.merge.sources[f].size) continue;
+    if (best == -1 || p->keys[f] < p->keys[best]) best = f;
+  }
+  return best;
+}
+
+/*
+Moves position p of the merge by delta rows, stopping at either end, and returns
+the number of rows moved. Forward takes the earliest next line of all files, which
+is a k-way merge done one row at a time. Backward takes the latest of the lines
+before p, the last file on a tie, which undoes exactly one forward step.
+*/
+int mergeStep(struct mergePosition *p, int delta){
+  int moved = 0;
+  for (; delta > 0; delta--, moved++) {
+    int f = mergePeek(p);
+    if (f == -1) break;
+    const struct mergeSource *src = &E.merge.sources[f];
+    size_t end = mergeLineEnd(src, p->offsets[f]);
+    p->before[f] = p->keys[f];
+    if (end + 1 >= src->size) {
+      p->offsets[f] = src->size;
+      p->keys[f] = LLONG_MAX;
+      continue;
+    }
+    // A line without a timestamp of its own is in the entry of the line before.
+    long long t = mergeLineTime(src, end + 1);
+    p->offsets[f] = end + 1;
+    if (t >= 0) p->keys[f] = t;
+  }
+  for (; delta < 0; delta++, moved++) {
+    int best = -1;
+    for (int f = 0; f < E.merge.numSources; f++) {
+      if (p->offsets[f] > 0 && (best == -1 || p->before[f] >= p->before[best])) best = f;
+    }
+    if (best == -1) break;
+    struct mergeSource *src = &E.merge.sources[best];
+    p->offsets[best] = mergeLineStart(src, p->offsets[best]);
+    p->keys[best] = p->before[best];
+    p->before[best] = mergeKeyBefore(src, p->offsets[best], p->keys[best]);
+  }
+  return moved;
+}
+
+/*
+Returns the timestamp of the first entry starting in a MERGE_SAMPLE_BYTES block of a
+file, reading it on first use, or LLONG_MAX when there is none up to the end.
+*/
+long long mergeSample(struct mergeSource *src, size_t block){
+  if (src->samples[block] != LLONG_MIN) return src->samples[block];
+  size_t off = block * MERGE_SAMPLE_BYTES;
+  if (off > 0) off = mergeLineEnd(src, off - 1) + 1;
+  long long t = LLONG_MAX;
+  while (off < src->size && (t = mergeLineTime(src, off)) < 0) {
+    t = LLONG_MAX;
+    off = mergeLineEnd(src, off) + 1;
+  }
+  src->samples[block] = t;
+  return t;
+}
+
+/*
+Returns the offset of the first line of a file logged at or after time. Binary
+search over the samples of the blocks, which are read only as the search reaches
+them, then a scan of one block.
+*/
+size_t mergeFindTime(struct mergeSource *src, long long time){
+  size_t lo = 0, hi = src->numSamples;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (mergeSample(src, mid) < time) lo = mid + 1; else hi = mid;
+  }
+  size_t off = lo > 0 ? (lo - 1) * MERGE_SAMPLE_BYTES : 0;
+  if (off > 0) off = mergeLineEnd(src, off - 1) + 1;
+  while (off < src->size) {
+    long long t = mergeLineTime(src, off);
+    if (t >= time) break;
+    off = mergeLineEnd(src, off) + 1;
+  }
+  return off < src->size ? off : src->size;
+}
+
+// Finds the timestamp format of a file from its first TIME_DETECT_LINES lines, like
+// timeDetect() does for the open file.
+enum timeFormat mergeDetect(const struct mergeSource *src){
+  int counts[TIME_CLOCK + 1] = {0};
+  size_t off = 0;
+  for (int i = 0; i < TIME_DETECT_LINES && off < src->size; i++) {
+    size_t end = mergeLineEnd(src, off);
+    timeDetectLine(src->data + off, end - off, counts);
+    off = end + 1;
+  }
+  return timeDetectBest(counts);
+}
+
+/*
+Maps a file read only for the merge view. The pages are only read as the view
+reaches them, so opening a set of large logs is immediate. Returns 0 on failure.
+*/
+int mergeOpen(struct mergeSource *src, const char *name){
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+  src->name = name;
+  src->data = data;
+  src->size = st.st_size;
+  src->format = mergeDetect(src);
+  src->numSamples = (src->size + MERGE_SAMPLE_BYTES - 1) / MERGE_SAMPLE_BYTES;
+  src->samples = memAlloc(MEM_TIME, sizeof(long long) * src->numSamples);
+  src->keys = memAlloc(MEM_TIME, sizeof(long long) * src->numSamples);
+  for (size_t i = 0; i < src->numSamples; i++) {
+    src->samples[i] = LLONG_MIN;
+    src->keys[i] = LLONG_MAX;
+  }
+  return 1;
+}
+
+// Unmaps a file opened by mergeOpen().
+void mergeClose(struct mergeSource *src){
+  munmap((void *)src->data, src->size);
+  memFree(MEM_TIME, src->samples, sizeof(long long) * src->numSamples);
+  memFree(MEM_TIME, src->keys, sizeof(long long) * src->numSamples);
+}
+
+// Whether position a of the merge comes before b. Offsets only grow along the merge,
+// so one smaller offset is enough to tell.
+int mergeBefore(const struct mergePosition *a, const struct mergePosition *b){
+  for (int f = 0; f < E.merge.numSources; f++) {
+    if (a->offsets[f] < b->offsets[f]) return 1;
+  }
+  return 0;
+}
+
+/*
+Adjusts the first merged row shown so the cursor row is inside the window, and
+finds the screen row of the cursor. Only the rows between the two are looked at.
+*/
+void mergeViewScroll(){
+  struct mergeView *v = &E.merge;
+  if (mergeBefore(&v->cursor, &v->top)) v->top = v->cursor;
+  struct mergePosition p = v->top;
+  int screenRow = 0;
+  while (mergeBefore(&p, &v->cursor) && screenRow < E.screenRows - 1) {
+    mergeStep(&p, 1);
+    screenRow++;
+  }
+  if (mergeBefore(&p, &v->cursor)) {
+    v->top = v->cursor;
+    screenRow = mergeStep(&v->top, -(E.screenRows - 1));
+  }
+  v->cursorScreenRow = screenRow;
+}
+
+/*** statistics ***/
+
+// Adds n to the count of key in a map, growing it at three quarters full.
+void statsMapAdd(struct statsMap *map, const char *key, size_t len, long n){
+  if (len > STATS_KEY_SIZE - 1) len = STATS_KEY_SIZE - 1;
+  if (map->count * 4 >= map->capacity * 3) {
+    struct statsMap grown = {NULL, map->capacity ? map->capacity * 2 : 16, 0};
+    grown.entries = memCalloc(MEM_STATS, grown.capacity, sizeof(struct statsEntry));
+    for (int i = 0; i < map->capacity; i++) {
+      struct statsEntry *e = &map->entries[i];
+      if (e->count) statsMapAdd(&grown, e->key, e->size, e->count);
+    }
+    memFree(MEM_STATS, map->entries, sizeof(struct statsEntry) * map->capacity);
+    *map = grown;
+  }
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)key[i]) * 16777619u;
+  for (int i = h & (map->capacity - 1);; i = (i + 1) & (map->capacity - 1)) {
+    struct statsEntry *e = &map->entries[i];
+    if (e->count == 0) {
+      memcpy(e->key, key, len);
+      e->size = len;
+      e->count = n;
+      map->count++;
+      return;
+    }
+    if (e->size == len && memcmp(e->key, key, len) == 0) {
+      e->count += n;
+      return;
+    }
+  }
+}
+
+void statsMapFree(struct statsMap *map){
+  memFree(MEM_STATS, map->entries, sizeof(struct statsEntry) * map->capacity);
+  *map = (struct statsMap){NULL, 0, 0};
+}
+
+// Whether the word of len bytes at s is a log level, ignoring case. Sets its usual name.
+int statsLevel(const char *s, size_t len, const char **name){
+  static const char *levels[] = {"TRACE", "DEBUG", "INFO", "WARN", "WARNING", "ERROR", "FATAL", "CRITICAL"};
+  for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+    if (strlen(levels[i]) == len && strncasecmp(levels[i], s, len) == 0) {
+      *name = levels[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+Finds what a line is counted under: its log level, the first word of its first
+STATS_LEVEL_BYTES bytes that is one, or with a field name the value of field=value
+or "field":value. Returns 0 when the line has none.
+*/
+int statsLineKey(const char *chars, size_t size, const char *field, const char **key, size_t *len){
+  if (field == NULL) {
+    size_t end = size < STATS_LEVEL_BYTES ? size : STATS_LEVEL_BYTES;
+    for (size_t i = 0; i < end;) {
+      if (!isalpha((unsigned char)chars[i])) {
+        i++;
+        continue;
+      }
+      size_t start = i;
+      while (i < end && isalpha((unsigned char)chars[i])) i++;
+      if (statsLevel(chars + start, i - start, key)) {
+        *len = strlen(*key);
+        return 1;
+      }
+    }
+    return 0;
+  }
+  size_t fieldLen = strlen(field);
+  if (fieldLen == 0) return 0;
+  for (const char *p = chars; p < chars + size && (p = memmem(p, size - (p - chars), field, fieldLen)) != NULL; p++) {
+    size_t at = p - chars + fieldLen;
+    // Only a whole name, not the end of a longer one.
+    if (p > chars && (isalnum((unsigned char)p[-1]) || p[-1] == '_')) continue;
+    if (at < size && p > chars && p[-1] == '"' && chars[at] == '"') at++;
+    while (at < size && chars[at] == ' ') at++;
+    if (at == size || (chars[at] != '=' && chars[at] != ':')) continue;
+    at++;
+    while (at < size && chars[at] == ' ') at++;
+    size_t start = at;
+    if (at < size && chars[at] == '"') {
+      start = ++at;
+      while (at < size && chars[at] != '"') at++;
+    } else {
+      while (at < size && chars[at] != ' ' && chars[at] != ',' && chars[at] != '}' && chars[at] != ';') at++;
+    }
+    *key = chars + start;
+    *len = at - start;
+    return 1;
+  }
+  return 0;
+}
+
+// Chunk task of a count, on a worker thread, with a map of its own.
+struct statsTask {
+  struct task task;
+  struct statsJob *job;
+  int chunk;
+  struct snapshot *snapshot;
+  int firstLine;
+  int endLine;
+  struct statsMap map;
+};
+
+void statsJobRelease(struct statsJob *job){
+  if (--job->refs > 0) return;
+  for (int i = 0; i < job->numChunks; i++) statsMapFree(&job->chunks[i].map);
+  memFree(MEM_STATS, job->chunks, sizeof(struct statsChunk) * job->numChunks);
+  cancelTokenRelease(job->token);
+  if (job->field) memFree(MEM_STATS, job->field, strlen(job->field) + 1);
+  memFree(MEM_STATS, job, sizeof(struct statsJob));
+}
+
+// Counts the lines of one chunk in the pass's snapshot.
+void statsTaskRun(struct task *task){
+  struct statsTask *st = (struct statsTask *)task;
+  struct lineIndex *snap = st->snapshot->index;
+  for (int at = st->firstLine; at < st->endLine; at++) {
+    if (at % 4096 == 0 && cancelTokenIsCancelled(st->job->token)) return;
+    size_t size, len;
+    const char *chars = snapshotLineChars(snap, at, &size);
+    const char *key;
+    if (statsLineKey(chars, size, st->job->field, &key, &len)) statsMapAdd(&st->map, key, len, 1);
+    else statsMapAdd(&st->map, "(none)", 6, 1);
+  }
+}
+
+/*
+Hands the counts of a chunk over to the job, on the main thread. When the buffer
+changed meanwhile they may be stale, and the chunk is counted again in a later pass.
+The last task of a pass releases its snapshot.
+*/
+void statsTaskComplete(struct task *task){
+  struct statsTask *st = (struct statsTask *)task;
+  struct statsJob *job = st->job;
+  if (job == E.stats && !cancelTokenIsCancelled(job->token)) {
+    struct statsChunk *chunk = &job->chunks[st->chunk];
+    if (st->snapshot->version == E.version) {
+      statsMapFree(&chunk->map);
+      chunk->map = st->map;
+      st->map = (struct statsMap){NULL, 0, 0};
+    } else {
+      chunk->dirty = 1;
+    }
+  }
+  if (--job->remaining == 0) {
+    snapshotRelease(job->snapshot);
+    job->snapshot = NULL;
+  }
+  statsMapFree(&st->map);
+  memFree(MEM_STATS, st, sizeof(struct statsTask));
+  statsJobRelease(job);
+}
+
+// Counts the dirty chunks of the job again, on a snapshot of the current version.
+void statsPass(struct statsJob *job){
+  job->snapshot = editorSnapshot();
+  for (int c = 0; c < job->numChunks; c++) {
+    struct statsChunk *chunk = &job->chunks[c];
+    if (!chunk->dirty) continue;
+    chunk->dirty = 0;
+    struct statsTask *st = memCalloc(MEM_STATS, 1, sizeof(struct statsTask));
+    st->task.run = statsTaskRun;
+    st->task.complete = statsTaskComplete;
+    st->job = job;
+    st->chunk = c;
+    st->snapshot = job->snapshot;
+    st->firstLine = chunk->firstLine;
+    st->endLine = chunk->endLine;
+    job->refs++;
+    job->remaining++;
+    taskSubmit(&st->task, job->token, TASK_BACKGROUND);
+  }
+  if (job->remaining == 0) {
+    snapshotRelease(job->snapshot);
+    job->snapshot = NULL;
+  }
+}
+
+// Stops the current count and drops its results.
+void statsStop(){
+  if (E.stats == NULL) return;
+  cancelTokenCancel(E.stats->token);
+  statsJobRelease(E.stats);
+  E.stats = NULL;
+}
+
+/*
+Starts counting the lines of the whole file by log level, or by the values of a
+field. The file is cut in chunks like a search, every chunk is counted by its own
+task into its own map, and the maps are only added up when shown.
+*/
+void statsStart(const char *field){
+  statsStop();
+  struct statsJob *job = memCalloc(MEM_STATS, 1, sizeof(struct statsJob));
+  if (field) {
+    job->field = memAlloc(MEM_STATS, strlen(field) + 1);
+    memcpy(job->field, field, strlen(field) + 1);
+  }
+  job->token = cancelTokenNew(MEM_STATS);
+  job->refs = 1;
+  job->seen = E.edits.head;
+  job->show = 1;
+  E.stats = job;
+
+  editorFlushActiveLine();
+  int capacity = E.text.size / SEARCH_CHUNK_SIZE + 1;
+  job->chunks = memCalloc(MEM_STATS, capacity, sizeof(struct statsChunk));
+  int first = 0;
+  for (int i = 1; i <= capacity && first < E.index->numLines; i++) {
+    int end = i == capacity ? E.index->numLines : snapshotLineAtOffset(E.index, i * SEARCH_CHUNK_SIZE);
+    if (end <= first) continue;
+    job->chunks[job->numChunks++] = (struct statsChunk){first, end, {NULL, 0, 0}, 1};
+    first = end;
+  }
+  job->chunks = memRealloc(MEM_STATS, job->chunks, sizeof(struct statsChunk) * capacity,
+                           sizeof(struct statsChunk) * job->numChunks);
+  statsPass(job);
+}
+
+int statsEntryCompare(const void *a, const void *b){
+  const struct statsEntry *x = a, *y = b;
+  if (x->count != y->count) return x->count > y->count ? -1 : 1;
+  return 0;
+}
+
+// Shows the counts added up over all chunks in the panel, most frequent first.
+void statsShow(struct statsJob *job){
+  struct statsMap total = {NULL, 0, 0};
+  long lines = 0;
+  int dirty = job->remaining > 0;
+  for (int c = 0; c < job->numChunks; c++) {
+    struct statsMap *map = &job->chunks[c].map;
+    dirty |= job->chunks[c].dirty;
+    for (int i = 0; i < map->capacity; i++) {
+      if (map->entries[i].count == 0) continue;
+      statsMapAdd(&total, map->entries[i].key, map->entries[i].size, map->entries[i].count);
+      lines += map->entries[i].count;
+    }
+  }
+  E.panelRows = 0;
+  editorPanelAdd("%s%s, %ld lines%s", job->field ? "values of " : "log levels", job->field ? job->field : "",
+                 lines, dirty ? ", updating" : "");
+  struct statsEntry *entries = memAlloc(MEM_STATS, sizeof(struct statsEntry) * total.count);
+  int n = 0;
+  for (int i = 0; i < total.capacity; i++) {
+    if (total.entries[i].count) entries[n++] = total.entries[i];
+  }
+  qsort(entries, n, sizeof(struct statsEntry), statsEntryCompare);
+  for (int i = 0; i < n && i < PANEL_ROWS - 1; i++) {
+    editorPanelAdd("  %-32.*s %12ld %5.1f%%", (int)entries[i].size, entries[i].key, entries[i].count,
+                   100.0 * entries[i].count / lines);
+  }
+  memFree(MEM_STATS, entries, sizeof(struct statsEntry) * total.count);
+  statsMapFree(&total);
+}
+
+/*
+Keeps the counts up to date with the edit log. Chunk bounds move with the lines,
+and the chunks holding edited lines are counted again in the background, so the
+totals follow the edits without counting the whole file again. Counts still being
+made are shown once the pass that was asked for is done.
+*/
+void statsObserve(){
+  struct statsJob *job = E.stats;
+  if (job == NULL) return;
+  struct editRecord rec;
+  int r;
+  while ((r = editLogRead(&job->seen, &rec)) > 0) {
+    int last = rec.line + (rec.lineDelta < 0 ? -rec.lineDelta : 0);
+    for (int c = 0; c < job->numChunks; c++) {
+      struct statsChunk *chunk = &job->chunks[c];
+      if (chunk->endLine <= rec.line) continue;
+      if (chunk->firstLine <= last) chunk->dirty = 1;
+      if (chunk->firstLine > rec.line) {
+        chunk->firstLine = chunk->firstLine + rec.lineDelta > rec.line ? chunk->firstLine + rec.lineDelta : rec.line + 1;
+      }
+      chunk->endLine = chunk->endLine + rec.lineDelta > rec.line ? chunk->endLine + rec.lineDelta : rec.line + 1;
+    }
+  }
+  if (r < 0) {
+    // Fell behind the log, everything is counted again.
+    for (int c = 0; c < job->numChunks; c++) job->chunks[c].dirty = 1;
+  }
+  if (job->numChunks) job->chunks[job->numChunks - 1].endLine = E.index->numLines;
+  if (job->remaining > 0) return;
+  int dirty = 0;
+  for (int c = 0; c < job->numChunks; c++) dirty |= job->chunks[c].dirty;
+  if (dirty) {
+    statsPass(job);
+  } else if (job->show) {
+    job->show = 0;
+    statsShow(job);
+  }
+}
+
+/*** minimap ***/
+
+/*
+Splits the lines into chunks of about the same number of lines, with no edits
+counted yet.
+*/
+void minimapReset(){
+  struct minimap *m = &E.minimap;
+  memFree(MEM_MINIMAP, m->lines, sizeof(long) * (m->numChunks + 1));
+  memFree(MEM_MINIMAP, m->edits, sizeof(long) * (m->numChunks + 1));
+  long numLines = E.index->numLines;
+  m->numChunks = numLines / MINIMAP_CHUNK_LINES + 1;
+  if (m->numChunks > MINIMAP_MAX_CHUNKS) m->numChunks = MINIMAP_MAX_CHUNKS;
+  m->lines = memCalloc(MEM_MINIMAP, m->numChunks + 1, sizeof(long));
+  m->edits = memCalloc(MEM_MINIMAP, m->numChunks + 1, sizeof(long));
+  for (int c = 0; c < m->numChunks; c++) {
+    fenwickAdd(m->lines, m->numChunks, c, numLines * (c + 1) / m->numChunks - numLines * c / m->numChunks);
+  }
+  m->seen = E.edits.head;
+}
+
+/*
+Counts one edit record in the chunk of its line. Lines split off the line join its
+chunk, and lines joined onto it leave the chunks they were in.
+*/
+void minimapApplyEdit(struct minimap *m, struct editRecord *rec){
+  int c = fenwickFind(m->lines, m->numChunks, rec->line);
+  if (c == m->numChunks) c = m->numChunks - 1;
+  fenwickAdd(m->edits, m->numChunks, c, 1);
+  if (rec->lineDelta > 0) fenwickAdd(m->lines, m->numChunks, c, rec->lineDelta);
+  long joined = rec->lineDelta < 0 ? -rec->lineDelta : 0;
+  while (joined > 0) {
+    int d = fenwickFind(m->lines, m->numChunks, rec->line + 1);
+    if (d == m->numChunks) break;
+    long left = fenwickSum(m->lines, d + 1) - (rec->line + 1);
+    long taken = left < joined ? left : joined;
+    fenwickAdd(m->lines, m->numChunks, d, -taken);
+    joined -= taken;
+  }
+}
+
+/*
+Counts the edits made since the last key. Edits are counted whether or not the
+minimap is shown, so it shows them all when it is opened.
+*/
+void minimapObserve(){
+  struct minimap *m = &E.minimap;
+  if (m->numChunks == 0) minimapReset();
+  struct editRecord rec;
+  int r;
+  while ((r = editLogRead(&m->seen, &rec)) > 0) minimapApplyEdit(m, &rec);
+  // Fell behind the log, the chunks no longer match the lines.
+  if (r < 0) minimapReset();
+}
+
+/*
+Returns the number of edits counted on the lines before at. Edits are only known
+per chunk, so the ones of the chunk holding at are spread evenly over its lines.
+*/
+long minimapEditsBefore(int at){
+  struct minimap *m = &E.minimap;
+  int c = fenwickFind(m->lines, m->numChunks, at);
+  if (c == m->numChunks) return fenwickSum(m->edits, m->numChunks);
+  long first = fenwickSum(m->lines, c);
+  long size = fenwickGet(m->lines, c);
+  return fenwickSum(m->edits, c) + fenwickGet(m->edits, c) * (at - first) / size;
+}
+
+// First line of the file shown by row r of the minimap, for r up to the number of rows.
+int minimapRowLine(int r){
+  return (long)E.index->numLines * r / E.screenRows;
+}
+
+/*
+Counts the matches and edits on the lines of each row of the minimap, two lookups
+per row in each tree.
+*/
+void minimapLayout(){
+  struct minimap *m = &E.minimap;
+  long matches = 0, edits = 0;
+  m->maxMatches = m->maxEdits = 1;
+  for (int r = 0; r <= E.screenRows; r++) {
+    int at = minimapRowLine(r);
+    long nextMatches = searchMatchesBefore(at);
+    long nextEdits = minimapEditsBefore(at);
+    if (r > 0) {
+      m->rowMatches[r - 1] = nextMatches - matches;
+      m->rowEdits[r - 1] = nextEdits - edits;
+      if (m->rowMatches[r - 1] > m->maxMatches) m->maxMatches = m->rowMatches[r - 1];
+      if (m->rowEdits[r - 1] > m->maxEdits) m->maxEdits = m->rowEdits[r - 1];
+    }
+    matches = nextMatches;
+    edits = nextEdits;
+  }
+}
+
+// Scales a count to a shade from 0 to 4, relative to the largest count of the rows.
+int minimapLevel(long count, long max){
+  return count == 0 ? 0 : 1 + 3 * count / max;
+}
+
+/*
+Returns what the minimap shows on row r, as a number the row is laid out again for
+when it changes: the shades of matches and edits, and whether the lines of the row
+are in the window.
+*/
+int minimapRowKey(int r){
+  struct minimap *m = &E.minimap;
+  int top = E.json.enabled ? E.json.topLine : E.rowOff;
+  int first = minimapRowLine(r), end = minimapRowLine(r + 1);
+  if (end == first) end++;
+  int shown = first < top + E.screenRows && end > top;
+  return 1 + minimapLevel(m->rowMatches[r], m->maxMatches) + 5 * minimapLevel(m->rowEdits[r], m->maxEdits) + 25 * shown;
+}
+
+/*** marks ***/
+
+// Position of a mark at a line and column.
+int64_t markPos(int line, int col){
+  return (int64_t)line << 32 | (uint32_t)col;
+}
+
+// Takes a node from the free list, growing the node array when it is empty.
+int markNodeNew(const char *name, int64_t pos){
+  struct markTree *t = &E.marks;
+  if (t->freeList == 0) {
+    int capacity = t->capacity ? t->capacity * 2 : 64;
+    t->nodes = memRealloc(MEM_MARKS, t->nodes, sizeof(struct markNode) * t->capacity,
+                          sizeof(struct markNode) * capacity);
+    // Node 0 stands for no node and is never handed out.
+    if (t->capacity == 0) memset(&t->nodes[0], 0, sizeof(struct markNode));
+    for (int i = capacity - 1; i >= (t->capacity ? t->capacity : 1); i--) {
+      t->nodes[i].priority = 0;
+      t->nodes[i].left = t->freeList;
+      t->freeList = i;
+    }
+    t->capacity = capacity;
+  }
+  int n = t->freeList;
+  struct markNode *node = &t->nodes[n];
+  t->freeList = node->left;
+  // xorshift32 priorities; a nonzero seed never gives 0.
+  if (t->seed == 0) t->seed = 2463534242u;
+  t->seed ^= t->seed << 13;
+  t->seed ^= t->seed >> 17;
+  t->seed ^= t->seed << 5;
+  node->pos = pos;
+  node->shift = 0;
+  node->priority = t->seed;
+  node->left = node->right = node->parent = 0;
+  snprintf(node->name, MARK_NAME_SIZE, "%s", name);
+  t->count++;
+  return n;
+}
+
+void markNodeFree(int n){
+  struct markTree *t = &E.marks;
+  t->nodes[n].priority = 0;
+  t->nodes[n].left = t->freeList;
+  t->freeList = n;
+  t->count--;
+}
+
+// Applies the pending shift of a node to its children.
+void markPush(int n){
+  struct markNode *nodes = E.marks.nodes;
+  int64_t shift = nodes[n].shift;
+  if (shift == 0) return;
+  if (nodes[n].left) {
+    nodes[nodes[n].left].pos += shift;
+    nodes[nodes[n].left].shift += shift;
+  }
+  if (nodes[n].right) {
+    nodes[nodes[n].right].pos += shift;
+    nodes[nodes[n].right].shift += shift;
+  }
+  nodes[n].shift = 0;
+}
+
+/*
+Splits the treap rooted at n into the nodes before (pos, idx) and the rest. Nodes at
+the same position are ordered by index, so every node has a distinct key; an idx of
+0 puts all the nodes at pos in the second part.
+*/
+void markSplit(int n, int64_t pos, int idx, int *l, int *r){
+  struct markNode *nodes = E.marks.nodes;
+  if (n == 0) {
+    *l = *r = 0;
+    return;
+  }
+  markPush(n);
+  if (nodes[n].pos < pos || (nodes[n].pos == pos && n < idx)) {
+    markSplit(nodes[n].right, pos, idx, &nodes[n].right, r);
+    if (nodes[n].right) nodes[nodes[n].right].parent = n;
+    *l = n;
+  } else {
+    markSplit(nodes[n].left, pos, idx, l, &nodes[n].left);
+    if (nodes[n].left) nodes[nodes[n].left].parent = n;
+    *r = n;
+  }
+}
+
+// Joins two treaps, all the nodes of a coming before the ones of b.
+int markMerge(int a, int b){
+  struct markNode *nodes = E.marks.nodes;
+  if (a == 0) return b;
+  if (b == 0) return a;
+  if (nodes[a].priority > nodes[b].priority) {
+    markPush(a);
+    int right = markMerge(nodes[a].right, b);
+    nodes[a].right = right;
+    nodes[right].parent = a;
+    return a;
+  }
+  markPush(b);
+  int left = markMerge(a, nodes[b].left);
+  nodes[b].left = left;
+  nodes[left].parent = b;
+  return b;
+}
+
+void markSetRoot(int n){
+  E.marks.root = n;
+  if (n) E.marks.nodes[n].parent = 0;
+}
+
+// Adds a node that is in no treap yet at its position.
+void markInsert(int n){
+  int l, r;
+  markSplit(E.marks.root, E.marks.nodes[n].pos, n, &l, &r);
+  markSetRoot(markMerge(markMerge(l, n), r));
+}
+
+// Returns the position of a node, adding up the shifts its ancestors still hold.
+int64_t markPosition(int n){
+  struct markNode *nodes = E.marks.nodes;
+  int64_t pos = nodes[n].pos;
+  for (int p = nodes[n].parent; p; p = nodes[p].parent) pos += nodes[p].shift;
+  return pos;
+}
+
+void markRemove(int n){
+  int64_t pos = markPosition(n);
+  int l, m, r;
+  markSplit(E.marks.root, pos, n, &l, &r);
+  markSplit(r, pos, n + 1, &m, &r);
+  markSetRoot(markMerge(l, r));
+  markNodeFree(n);
+}
+
+/*
+Returns where an edit record moves a mark on one of the lines it edited. Text after
+the mark's column moves it along its line, a split moves it to the new line when
+it was after the split, and a join moves it onto the end of the line above.
+*/
+int64_t markMove(int64_t pos, struct editRecord *rec){
+  int line = pos >> 32;
+  int col = pos & 0xffffffff;
+  if (line != rec->line) return markPos(rec->line, rec->col + col);
+  if (rec->lineDelta > 0) {
+    return col >= rec->col ? markPos(line + rec->lineDelta, col - rec->col) : pos;
+  }
+  if (col >= rec->col + rec->removed) col += rec->inserted - rec->removed;
+  else if (col > rec->col) col = rec->col;
+  return markPos(line, col);
+}
+
+/*
+Moves the marks of a treap split off the edited lines back into the marks, each to
+where the edit put it. add is the shift of the ancestors not yet pushed down.
+*/
+void markReinsert(int n, int64_t add, struct editRecord *rec){
+  if (n == 0) return;
+  struct markNode *node = &E.marks.nodes[n];
+  int left = node->left, right = node->right;
+  int64_t pos = node->pos + add, shift = add + node->shift;
+  markReinsert(left, shift, rec);
+  markReinsert(right, shift, rec);
+  node->pos = markMove(pos, rec);
+  node->shift = 0;
+  node->left = node->right = 0;
+  markInsert(n);
+}
+
+/*
+Applies one edit record to the marks: the marks past the edited lines move by its
+line delta with one shift of their subtree, and the few on the edited lines are
+moved one by one.
+*/
+void markApplyEdit(struct editRecord *rec){
+  struct markNode *nodes = E.marks.nodes;
+  int last = rec->line + (rec->lineDelta < 0 ? -rec->lineDelta : 0);
+  int before, edited, after;
+  markSplit(E.marks.root, markPos(rec->line, 0), 0, &before, &edited);
+  markSplit(edited, markPos(last + 1, 0), 0, &edited, &after);
+  if (after && rec->lineDelta) {
+    int64_t shift = rec->lineDelta * ((int64_t)1 << 32);
+    nodes[after].pos += shift;
+    nodes[after].shift += shift;
+  }
+  markSetRoot(markMerge(before, after));
+  markReinsert(edited, 0, rec);
+}
+
+// Keeps the marks on their text as it is edited.
+void marksObserve(){
+  struct markTree *t = &E.marks;
+  if (t->root == 0) {
+    t->seen = E.edits.head;
+    return;
+  }
+  struct editRecord rec;
+  while (editLogRead(&t->seen, &rec) > 0) markApplyEdit(&rec);
+}
+
+// Returns the node of the mark called name, or 0 when there is none. Unnamed
+// marks, like the positions of the jump list, are never found.
+int markFind(const char *name){
+  struct markTree *t = &E.marks;
+  if (*name == '\0') return 0;
+  for (int n = 1; n < t->capacity; n++) {
+    if (t->nodes[n].priority && t->nodes[n].name[0] && strcmp(t->nodes[n].name, name) == 0) return n;
+  }
+  return 0;
+}
+
+// Returns whether name can name a mark, telling the user when it cannot.
+int markNameValid(const char *name){
+  if (*name == '\0' || strlen(name) >= MARK_NAME_SIZE) {
+    editorSetStatusMessage("Mark names are 1 to %d bytes long", MARK_NAME_SIZE - 1);
+    return 0;
+  }
+  return 1;
+}
+
+// Sets the mark called name at the cursor, moving it if it was set already.
+void markSet(const char *name){
+  if (!markNameValid(name)) return;
+  int n = markFind(name);
+  if (n) markRemove(n);
+  markInsert(markNodeNew(name, markPos(E.cy, E.cx)));
+  editorSetStatusMessage("Mark %s set", name);
+}
+
+void markUnset(const char *name){
+  if (!markNameValid(name)) return;
+  int n = markFind(name);
+  if (n == 0) {
+    editorSetStatusMessage("No mark %s", name);
+    return;
+  }
+  markRemove(n);
+  editorSetStatusMessage("Mark %s removed", name);
+}
+
+// Moves the cursor to a position, kept inside the text.
+void editorGotoPosition(int64_t pos){
+  int line = pos >> 32;
+  int col = pos & 0xffffffff;
+  if (line < 0) line = 0;
+  if (col < 0) col = 0;
+  if (line > E.index->numLines) line = E.index->numLines;
+  int lineLength = line < E.index->numLines ? (int)lineSize(line) : 0;
+  if (col > lineLength) col = lineLength;
+  if (col < lineLength) col = lineClusterStart(line, col);
+  E.cy = line;
+  E.cx = col;
+}
+
+void markGoto(const char *name){
+  if (!markNameValid(name)) return;
+  int n = markFind(name);
+  if (n == 0) {
+    editorSetStatusMessage("No mark %s", name);
+    return;
+  }
+  jumpPush(E.cy, E.cx);
+  editorGotoPosition(markPosition(n));
+}
+
+// Adds the named marks of a treap to the panel in order, while there is room.
+void markListAdd(int n, int64_t add){
+  if (n == 0 || E.panelRows == PANEL_ROWS) return;
+  struct markNode *node = &E.marks.nodes[n];
+  int64_t pos = node->pos + add;
+  markListAdd(node->left, add + node->shift);
+  if (node->name[0] && E.panelRows < PANEL_ROWS) {
+    editorPanelAdd("  %-*s line %d, column %d", MARK_NAME_SIZE, node->name, (int)(pos >> 32) + 1,
+                   (int)(pos & 0xffffffff) + 1);
+  }
+  markListAdd(node->right, add + node->shift);
+}
+
+// Shows the marks in the panel, in the order they come in the file.
+void markList(){
+  struct markTree *t = &E.marks;
+  int named = 0;
+  for (int n = 1; n < t->capacity; n++) named += t->nodes[n].priority && t->nodes[n].name[0];
+  E.panelRows = 0;
+  editorPanelAdd("%d marks", named);
+  markListAdd(t->root, 0);
+}
+
+/*** jump list ***/
+
+// Drops the entries of the jump list from the one at i on.
+void jumpTruncate(int i){
+  struct jumpList *j = &E.jumps;
+  while (j->count > i) markRemove(j->anchors[--j->count]);
+  if (j->current > j->count) j->current = j->count;
+}
+
+// Adds a position at the end of the jump list, dropping the oldest one when it is full.
+void jumpAppend(int line, int col){
+  struct jumpList *j = &E.jumps;
+  if (j->count == JUMP_LIST_SIZE) {
+    markRemove(j->anchors[0]);
+    memmove(j->anchors, j->anchors + 1, sizeof(int) * --j->count);
+  }
+  int n = markNodeNew("", markPos(line, col));
+  markInsert(n);
+  j->anchors[j->count++] = n;
+}
+
+/*
+Records that the cursor jumps away from a position. Like in a browser, the positions
+gone back over are forgotten, and a jump from the line of the newest position only
+moves that position.
+*/
+void jumpPush(int line, int col){
+  struct jumpList *j = &E.jumps;
+  jumpTruncate(j->current);
+  if (j->count && (markPosition(j->anchors[j->count - 1]) >> 32) == line) jumpTruncate(j->count - 1);
+  jumpAppend(line, col);
+  j->current = j->count;
+}
+
+// Moves the cursor to the position before the current one in the jump list.
+void jumpBack(){
+  struct jumpList *j = &E.jumps;
+  if (j->current == 0) {
+    editorSetStatusMessage("No older position");
+    return;
+  }
+  // Going back from past the newest position keeps the cursor for going forward again.
+  if (j->current == j->count) {
+    jumpPush(E.cy, E.cx);
+    // It took the place of a position on the same line.
+    if (--j->current == 0) {
+      editorSetStatusMessage("No older position");
+      return;
+    }
+  }
+  editorGotoPosition(markPosition(j->anchors[--j->current]));
+}
+
+// Moves the cursor to the position after the current one in the jump list.
+void jumpForward(){
+  struct jumpList *j = &E.jumps;
+  if (j->current + 1 >= j->count) {
+    editorSetStatusMessage("No newer position");
+    return;
+  }
+  editorGotoPosition(markPosition(j->anchors[++j->current]));
+}
+
+/*** editor operations ***/
+
+// Adds an empty line after the last one, for typing past the end of the file.
+void editorAppendLine(){
+  lineIndexAppend(E.text.size, 0);
+  editLogEmit(E.index->numLines - 1, 0, 0, 0, 1);
+}
+
+// Inserts a character at the cursor.
+void editorInsertChar(int c){
+  if (E.cy == E.index->numLines) editorAppendLine();
+  editorActivateLine(E.cy);
+  gapBufferMoveGap(&E.active, E.cx);
+  gapBufferInsert(&E.active, c);
+  lineSetSize(E.cy, gapBufferLength(&E.active), E.cx);
+  editLogEmit(E.cy, E.cx, 0, 1, 0);
+  E.cx++;
+}
+
+/*
+Splits the line at the cursor. The text after the cursor becomes a new edited line
+below; it is taken from behind the gap of the active line, so nothing is copied
+twice.
+*/
+void editorInsertNewline(){
+  if (E.cy == E.index->numLines) {
+    editorAppendLine();
+  } else {
+    editorActivateLine(E.cy);
+    gapBufferMoveGap(&E.active, E.cx);
+    size_t tail = E.active.capacity - E.active.gapEnd;
+    lineIndexInsert(E.cy + 1, lineOffset(E.cy), 0);
+    editRow *row = lineEditRow(E.cy + 1);
+    editRowReserve(row, tail);
+    memcpy(editRowChars(row), E.active.chars + E.active.gapEnd, tail);
+    row->size = tail;
+    lineSetSize(E.cy + 1, tail, 0);
+    E.active.gapEnd = E.active.capacity;
+    lineSetSize(E.cy, E.active.gapStart, E.cx);
+    editLogEmit(E.cy, E.cx, 0, 1, 1);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// Deletes the grapheme cluster left of the cursor. At the start of a line, joins the
+// line onto the one above.
+void editorDelChar(){
+  if (E.cy == E.index->numLines || (E.cx == 0 && E.cy == 0)) return;
+  if (E.cx == 0) {
+    editorFlushActiveLine();
+    int prev = E.cy - 1;
+    size_t size = lineSize(prev);
+    editorActivateLine(prev);
+    gapBufferMoveGap(&E.active, size);
+    const char *chars = lineChars(E.cy);
+    for (size_t j = 0; j < lineSize(E.cy); j++) gapBufferInsert(&E.active, chars[j]);
+    lineIndexRemove(E.cy);
+    lineSetSize(prev, gapBufferLength(&E.active), size);
+    editLogEmit(prev, size, 1, 0, -1);
+    E.cy = prev;
+    E.cx = size;
+    return;
+  }
+  // The whole grapheme cluster goes, not just its last byte.
+  int start = linePrevCluster(E.cy, E.cx);
+  editorActivateLine(E.cy);
+  gapBufferMoveGap(&E.active, E.cx);
+  E.active.gapStart -= E.cx - start;
+  lineSetSize(E.cy, gapBufferLength(&E.active), start);
+  editLogEmit(E.cy, start, E.cx - start, 0, 0);
+  E.cx = start;
+}
+
+// Lets every observer catch up with the edits made since the last key.
+void editorObserveEdits(){
+  renderClockObserve();
+  searchObserve();
+  statsObserve();
+  minimapObserve();
+  marksObserve();
+}
+
+/*** memory budget ***/
+
+/*
+Brings memory use back under the budget by evicting caches. Only caches can be
+dropped, the text itself has to stay. Rendered lines go first, in clock order, then
+the JSON view rows and last the search matches, which take a background pass to
+find again. Lines on or near the screen are kept since they are needed for the next
+refresh anyway. Statistics and the grapheme table are not caches and stay.
+Runs once per key press, between edits, so nothing evicted is still in use.
+*/
+void editorEnforceBudget(){
+  if (E.memBudget == 0) return;
+  for (int i = 0; i < E.clock.capacity && memTotal() > E.memBudget; i++) {
+    int slot = E.clock.hand;
+    E.clock.hand = (E.clock.hand + 1) % E.clock.capacity;
+    int at = E.clock.lines[slot];
+    if (at != -1 && editorViewportDistance(at) > E.screenRows) lineInvalidateRender(at);
+  }
+  if (memTotal() > E.memBudget) jsonViewShrink();
+  if (memTotal() > E.memBudget) searchShrink();
+}
+
+/*** file i/o ***/
+
+// Finds the newlines in one chunk of the text buffer, on a worker thread.
+struct indexTask {
+  struct task task;
+  size_t start;
+  size_t end;
+  // Positions of the newlines found, in order.
+  size_t *newlines;
+  size_t count;
+  size_t capacity;
+  int *remaining;
+};
+
+void indexTaskRun(struct task *task){
+  struct indexTask *it = (struct indexTask *)task;
+  const char *data = E.text.data;
+  size_t pos = it->start;
+  while (pos < it->end) {
+    char *newline = memchr(data + pos, '\n', it->end - pos);
+    if (newline == NULL) break;
+    if (it->count == it->capacity) {
+      size_t capacity = it->capacity ? it->capacity * 2 : 4096;
+      it->newlines = memRealloc(MEM_LINE_INDEX, it->newlines,
+                                sizeof(size_t) * it->capacity, sizeof(size_t) * capacity);
+      it->capacity = capacity;
+    }
+    pos = newline - data;
+    it->newlines[it->count++] = pos++;
+  }
+}
+
+void indexTaskComplete(struct task *task){
+  struct indexTask *it = (struct indexTask *)task;
+  (*it->remaining)--;
+}
+
+// Adds the line ending at end to the index, stripping the carriage return of \r\n line endings.
+void editorIndexLine(size_t start, size_t end){
+  lineIndexAppend(start, (end > start && E.text.data[end - 1] == '\r') ? end - start - 1 : end - start);
+}
+
+/*
+Reads the whole file into a single text buffer and records where each line starts.
+The lines point into the buffer, so loading does not need an allocation per line.
+*/
+void editorOpen(const char *filename){
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("editorOpen - open");
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) die("editorOpen - fstat");
+
+  textBufferAlloc(&E.text, st.st_size);
+  while (E.text.size < (size_t)st.st_size) {
+    ssize_t nread = read(fd, E.text.data + E.text.size, st.st_size - E.text.size);
+    if (nread == -1) {
+      if (errno == EINTR) continue;
+      die("editorOpen - read");
+    }
+    // The file shrank while we were reading it.
+    if (nread == 0) break;
+    E.text.size += nread;
+  }
+  close(fd);
+
+  /*
+    Split the text into lines. Finding the newlines is the slow part on big files,
+    so every chunk is scanned by its own task. The line index is then filled in
+    order from the results.
+  */
+  int numChunks = (E.text.size + INDEX_CHUNK_SIZE - 1) / INDEX_CHUNK_SIZE;
+  int remaining = numChunks;
+  struct indexTask *chunks = memCalloc(MEM_LINE_INDEX, numChunks, sizeof(struct indexTask));
+  for (int i = 0; i < numChunks; i++) {
+    chunks[i].task.run = indexTaskRun;
+    chunks[i].task.complete = indexTaskComplete;
+    chunks[i].start = i * INDEX_CHUNK_SIZE;
+    chunks[i].end = chunks[i].start + INDEX_CHUNK_SIZE < E.text.size ? chunks[i].start + INDEX_CHUNK_SIZE : E.text.size;
+    chunks[i].remaining = &remaining;
+    taskSubmit(&chunks[i].task, NULL, TASK_VIEWPORT);
+  }
+  taskPoolWait(&remaining);
+
+  size_t start = 0;
+  for (int i = 0; i < numChunks; i++) {
+    for (size_t j = 0; j < chunks[i].count; j++) {
+      editorIndexLine(start, chunks[i].newlines[j]);
+      start = chunks[i].newlines[j] + 1;
+    }
+    memFree(MEM_LINE_INDEX, chunks[i].newlines, sizeof(size_t) * chunks[i].capacity);
+  }
+  // The last line has no newline at its end.
+  if (start < E.text.size) editorIndexLine(start, E.text.size);
+  memFree(MEM_LINE_INDEX, chunks, sizeof(struct indexTask) * numChunks);
+}
+
+/*** json view ***/
+
+// Whether c is whitespace between JSON tokens.
+int jsonSpace(char c){
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+Finds the structural characters of JSON text, the { } [ ] , and : outside strings,
+in the next block of 16 bytes of a scan, and puts their offsets in scan->found.
+Returns 0 at the end of the text. With SSE2 a block costs a few compares: they give
+bit masks of the quotes and structural characters, and a prefix XOR of the quote
+mask marks the bytes inside strings, carrying over from one block to the next.
+Blocks with a backslash, which can escape a quote, go a byte at a time.
+Scanning block by block lets the caller use the structurals as they are found,
+without an array of them for the whole line.
+*/
+int jsonScanBlock(struct jsonScan *scan){
+  const char *s = scan->s;
+  size_t i = scan->pos;
+  if (i >= scan->len) return 0;
+  scan->count = 0;
+#ifdef __SSE2__
+  if (i + 16 <= scan->len && !scan->escaped) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned backslash = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+    if (backslash == 0) {
+      unsigned quotes = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+      __m128i structural = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('{')), _mm_cmpeq_epi8(block, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('[')), _mm_cmpeq_epi8(block, _mm_set1_epi8(']'))));
+      structural = _mm_or_si128(structural,
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(',')), _mm_cmpeq_epi8(block, _mm_set1_epi8(':'))));
+      // Bit k of strings is set when an odd number of quotes is at or before byte k.
+      unsigned strings = quotes;
+      strings ^= strings << 1;
+      strings ^= strings << 2;
+      strings ^= strings << 4;
+      strings ^= strings << 8;
+      if (scan->inString) strings = ~strings;
+      strings &= 0xffff;
+      unsigned mask = _mm_movemask_epi8(structural) & ~strings;
+      while (mask) {
+        scan->found[scan->count++] = i + __builtin_ctz(mask);
+        mask &= mask - 1;
+      }
+      scan->inString = strings >> 15;
+      scan->pos = i + 16;
+      return 1;
+    }
+  }
+#endif
+  size_t end = i + 16 < scan->len ? i + 16 : scan->len;
+  for (; i < end; i++) {
+    char c = s[i];
+    if (scan->inString) {
+      if (scan->escaped) scan->escaped = 0;
+      else if (c == '\\') scan->escaped = 1;
+      else if (c == '"') scan->inString = 0;
+    } else if (c == '"') {
+      scan->inString = 1;
+    } else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ',' || c == ':') {
+      scan->found[scan->count++] = i;
+    }
+  }
+  scan->pos = end;
+  return 1;
+}
+
+// Adds the view row for bytes [start, end) of a line, without surrounding whitespace.
+void jsonLayoutAdd(struct jsonLayout *layout, int *capacity, const char *s, size_t start, size_t end, int depth){
+  while (start < end && jsonSpace(s[start])) start++;
+  while (end > start && jsonSpace(s[end - 1])) end--;
+  if (start == end && layout->numRows > 0) return;
+  if (layout->numRows == *capacity) {
+    int grown = *capacity ? *capacity * 2 : 8;
+    layout->rows = memRealloc(MEM_JSON, layout->rows, sizeof(struct jsonRow) * *capacity, sizeof(struct jsonRow) * grown);
+    *capacity = grown;
+  }
+  layout->rows[layout->numRows++] = (struct jsonRow){start, end, depth < 0 ? 0 : depth};
+}
+
+/*
+Splits a line holding a JSON value into view rows, the way a pretty printer would:
+a row ends after an opening bracket and after a comma, and a closing bracket starts
+a new row one level out. Empty objects and arrays stay on their row. Lines that do
+not start with { or [ are a single row.
+*/
+void jsonLayoutLine(struct jsonLayout *layout, const char *s, size_t len){
+  int capacity = 0;
+  layout->rows = NULL;
+  layout->numRows = 0;
+  size_t first = 0;
+  while (first < len && jsonSpace(s[first])) first++;
+  if (first == len || (s[first] != '{' && s[first] != '[')) {
+    jsonLayoutAdd(layout, &capacity, s, 0, len, 0);
+    return;
+  }
+  struct jsonScan scan = {.s = s, .len = len};
+  size_t rowStart = first;
+  int depth = 0, skip = 0;
+  while (jsonScanBlock(&scan)) {
+    for (int k = 0; k < scan.count; k++) {
+      size_t p = scan.found[k];
+      char c = s[p];
+      if (skip) {
+        skip = 0;
+      } else if (c == '{' || c == '[') {
+        size_t next = p + 1;
+        while (next < len && jsonSpace(s[next])) next++;
+        if (next < len && s[next] == (c == '{' ? '}' : ']')) {
+          // Empty, the closing bracket is the next structural.
+          skip = 1;
+          continue;
+        }
+        jsonLayoutAdd(layout, &capacity, s, rowStart, p + 1, depth);
+        depth++;
+        rowStart = p + 1;
+      } else if (c == ',') {
+        jsonLayoutAdd(layout, &capacity, s, rowStart, p + 1, depth);
+        rowStart = p + 1;
+      } else if (c == '}' || c == ']') {
+        jsonLayoutAdd(layout, &capacity, s, rowStart, p, depth);
+        depth--;
+        rowStart = p;
+      }
+    }
+  }
+  if (rowStart < len) jsonLayoutAdd(layout, &capacity, s, rowStart, len, depth);
+  // Give back the unused tail, freeing counts the rows in use.
+  if (capacity > layout->numRows) {
+    layout->rows = memRealloc(MEM_JSON, layout->rows, sizeof(struct jsonRow) * capacity,
+                              sizeof(struct jsonRow) * layout->numRows);
+  }
+}
+
+// Returns the view rows of a line, tokenizing it when it is not cached.
+struct jsonLayout *jsonRows(int at){
+  struct jsonLayout *layout = &E.json.cache[at % JSON_CACHE_LINES];
+  if (layout->line == at) return layout;
+  if (layout->line != -1) memFree(MEM_JSON, layout->rows, sizeof(struct jsonRow) * layout->numRows);
+  size_t size;
+  const char *chars = lineContiguous(at, &size);
+  jsonLayoutLine(layout, chars, size);
+  layout->line = at;
+  return layout;
+}
+
+// Drops the cached view rows of every line.
+void jsonViewClear(){
+  for (int i = 0; i < JSON_CACHE_LINES; i++) {
+    struct jsonLayout *layout = &E.json.cache[i];
+    if (layout->line != -1) memFree(MEM_JSON, layout->rows, sizeof(struct jsonRow) * layout->numRows);
+    layout->line = -1;
+  }
+  E.json.stamp++;
+}
+
+/*
+Drops the cached view rows of the lines away from the screen, or of every line
+when the view is off. They are the same when tokenized again, so the layout keys
+stay valid.
+*/
+void jsonViewShrink(){
+  for (int i = 0; i < JSON_CACHE_LINES && memTotal() > E.memBudget; i++) {
+    struct jsonLayout *layout = &E.json.cache[i];
+    if (layout->line == -1) continue;
+    if (E.json.enabled && layout->line > E.json.topLine - E.screenRows && layout->line < E.json.topLine + 2 * E.screenRows) continue;
+    memFree(MEM_JSON, layout->rows, sizeof(struct jsonRow) * layout->numRows);
+    layout->line = -1;
+  }
+}
+
+// Moves the view position (line, row) by delta view rows, stopping at the first and
+// last rows of the file. Returns the number of rows it moved.
+int jsonViewStep(int *line, int *row, int delta){
+  int moved = 0;
+  for (; delta > 0; delta--, moved++) {
+    if (*row + 1 < jsonRows(*line)->numRows) {
+      (*row)++;
+    } else if (*line + 1 < E.index->numLines) {
+      (*line)++;
+      *row = 0;
+    } else {
+      break;
+    }
+  }
+  for (; delta < 0; delta++, moved++) {
+    if (*row > 0) {
+      (*row)--;
+    } else if (*line > 0) {
+      (*line)--;
+      *row = jsonRows(*line)->numRows - 1;
+    } else {
+      break;
+    }
+  }
+  return moved;
+}
+
+/*
+Adjusts the first view row shown so the cursor row is inside the window, and finds
+the screen row of the cursor. Only the rows between the two are looked at, so the
+cost does not depend on the size of the file.
+*/
+void jsonViewScroll(){
+  struct jsonView *v = &E.json;
+  if (v->cursorLine < v->topLine || (v->cursorLine == v->topLine && v->cursorRow < v->topRow)) {
+    v->topLine = v->cursorLine;
+    v->topRow = v->cursorRow;
+  }
+  int line = v->topLine, row = v->topRow, screenRow = 0;
+  while ((line != v->cursorLine || row != v->cursorRow) && screenRow < E.screenRows - 1) {
+    jsonViewStep(&line, &row, 1);
+    screenRow++;
+  }
+  if (line != v->cursorLine || row != v->cursorRow) {
+    v->topLine = v->cursorLine;
+    v->topRow = v->cursorRow;
+    screenRow = jsonViewStep(&v->topLine, &v->topRow, -(E.screenRows - 1));
+  }
+  v->cursorScreenRow = screenRow;
+}
+
+/*** append buffer ***/
+
+// Appends len bytes of s to the buffer. Its memory is counted as render memory.
+void abAppend(struct abuf *ab, const char *s, int len){
+  ab->b = memRealloc(MEM_RENDER, ab->b, ab->len, ab->len + len);
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab){
+  memFree(MEM_RENDER, ab->b, ab->len);
+}
+
+/*** layout ***/
+
+void gridAlloc(struct grid *grid, int numRows, int numColumns){
+  grid->rows = memCalloc(MEM_RENDER, numRows, sizeof(struct gridRow));
+  for (int r = 0; r < numRows; r++) {
+    grid->rows[r].cells = memAlloc(MEM_RENDER, sizeof(struct cell) * numColumns);
+  }
+  grid->numRows = numRows;
+  grid->numColumns = numColumns;
+  grid->valid = 0;
+}
+
+void gridFree(struct grid *grid){
+  for (int r = 0; r < grid->numRows; r++) {
+    memFree(MEM_RENDER, grid->rows[r].cells, sizeof(struct cell) * grid->numColumns);
+  }
+  memFree(MEM_RENDER, grid->rows, sizeof(struct gridRow) * grid->numRows);
+}
+
+// Maps a kind of highlighting to an ANSI foreground color code.
+int editorHighlightToColor(enum editorHighlight hl){
+  switch (hl) {
+    case HL_NUMBER: return 31;
+    case HL_MATCH: return 34;
+    default: return 39;
+  }
+}
+
+// Returns the index of the given colors in the attribute table, adding them if needed.
+uint16_t attrIntern(int fg, int inverse){
+  struct attrTable *table = &E.attrs;
+  for (int i = 0; i < table->count; i++) {
+    if (table->attrs[i].fg == fg && table->attrs[i].inverse == inverse) return i;
+  }
+  if (table->count == ATTR_TABLE_SIZE) return 0;
+  struct cellAttr *attr = &table->attrs[table->count];
+  attr->fg = fg;
+  attr->inverse = inverse;
+  // Reset first, so the sequence does not depend on the colors before it.
+  attr->sgrLen = snprintf(attr->sgr, sizeof(attr->sgr), "\x1b[0%s;%dm", inverse ? ";7" : "", fg);
+  return table->count++;
+}
+
+// Lays out length bytes of UTF-8 text at the start of a row, one cell per code point,
+// all with attribute attr.
+void gridRowSetText(struct gridRow *row, const char *chars, size_t length, uint16_t attr){
+  int n = 0;
+  for (size_t j = 0; j < length;) {
+    struct cell *cell = &row->cells[n++];
+    j += utf8Decode(chars + j, length - j, &cell->glyph);
+    cell->attr = attr;
+    cell->width = 1;
+    cell->pad = 0;
+  }
+  row->length = n;
+}
+
+/*
+Lays out the grapheme clusters of chars[from, to) in a row from cell n on, up to the
+width of the text, and returns the number of cells the row has then. Like in the
+render text, tabs advance to the next multiple of TAB_STOP and wide clusters are
+followed by cells of width 0. Other control characters, and a wide cluster cut by the
+edge of the window, show as spaces.
+*/
+int gridRowAddClusters(struct gridRow *row, int n, const char *chars, size_t from, size_t to){
+  while (from < to && n < E.textColumns) {
+    int width;
+    size_t next = graphemeNext(chars, to, from, &width);
+    unsigned char c = chars[from];
+    if (c == '\t') {
+      for (int spaces = TAB_STOP - n % TAB_STOP; spaces > 0 && n < E.textColumns; spaces--) {
+        row->cells[n++] = (struct cell){' ', 0, 1, 0};
+      }
+    } else if (c < 0x20) {
+      row->cells[n++] = (struct cell){' ', 0, 1, 0};
+    } else if (n + width > E.textColumns) {
+      while (n < E.textColumns) row->cells[n++] = (struct cell){' ', 0, 1, 0};
+    } else if (width > 0) {
+      row->cells[n++] = (struct cell){graphemeGlyph(chars + from, next - from), 0, width, 0};
+      for (int i = 1; i < width; i++) row->cells[n++] = (struct cell){0, 0, 0, 0};
+    }
+    from = next;
+  }
+  return n;
+}
+
+// Lays out a row of the JSON view: the range of the line, indented, up to the width
+// of the screen.
+void gridRowSetJson(struct gridRow *row, int at, const struct jsonRow *json){
+  size_t size;
+  const char *chars = lineContiguous(at, &size);
+  int n = 0;
+  for (int i = 0; i < json->depth * JSON_INDENT && n < E.textColumns; i++) {
+    row->cells[n++] = (struct cell){' ', 0, 1, 0};
+  }
+  row->length = gridRowAddClusters(row, n, chars, json->start, json->end);
+}
+
+/*
+Lays out a row of the merge view: the number of the file it comes from, in inverted
+colors, then the line starting at offset off of that file.
+*/
+void gridRowSetMerge(struct gridRow *row, int file, size_t off){
+  const struct mergeSource *src = &E.merge.sources[file];
+  size_t end = mergeLineEnd(src, off);
+  char tag[8];
+  int n = snprintf(tag, sizeof(tag), "%d", file + 1);
+  uint16_t attr = attrIntern(39, 1);
+  for (int i = 0; i < n && i < E.textColumns; i++) row->cells[i] = (struct cell){tag[i], attr, 1, 0};
+  if (n < E.textColumns) row->cells[n++] = (struct cell){' ', 0, 1, 0};
+  row->length = gridRowAddClusters(row, n, src->data, off, end);
+}
+
+/*
+Pads a row with spaces to the width of the text and adds the minimap cells for key,
+see minimapRowKey(): the shade of matches in the color of matches, then the shade of
+edits. Rows of the lines in the window are shown inverted.
+*/
+void gridRowSetMap(struct gridRow *row, int key){
+  static const uint32_t shades[] = {' ', 0x2591, 0x2592, 0x2593, 0x2588};
+  key--;
+  int shown = key / 25;
+  while (row->length < E.textColumns) row->cells[row->length++] = (struct cell){' ', 0, 1, 0};
+  row->cells[row->length++] = (struct cell){shades[key % 5], attrIntern(editorHighlightToColor(HL_MATCH), shown), 1, 0};
+  row->cells[row->length++] = (struct cell){shades[key / 5 % 5], attrIntern(33, shown), 1, 0};
+}
+
+/*
+Steps to the next grapheme cluster of a render in display order, setting its bytes
+[*start, *end) and its width. pos is the byte offset for lines shown in logical
+order, and the index in the visual order for the others. Returns 0 at the end.
+*/
+int renderNextCluster(struct renderCache *render, size_t *pos, size_t *start, size_t *end, int *width){
+  if (render->visual) {
+    if (*pos == (size_t)render->numVisual) return 0;
+    struct visualCluster *v = &render->visual[(*pos)++];
+    *start = v->start;
+    *end = v->start + v->size;
+    *width = v->width;
+    return 1;
+  }
+  if (*pos == render->size) return 0;
+  *start = *pos;
+  *end = *pos = graphemeNext(render->chars, render->size, *pos, width);
+  return 1;
+}
+
+// Returns the first highlight span of a render that ends after byte j, by binary
+// search over the spans, which are sorted and do not overlap.
+int renderSpanAt(const struct renderCache *render, size_t j){
+  int lo = 0, hi = render->numSpans;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (render->spans[mid].start + render->spans[mid].size <= j) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/*
+Lays out the grapheme clusters of render text that fall in screen columns
+[colOff, colOff + columns), colored by the line's highlight spans. A wide cluster cut
+by either edge of the window shows as spaces.
+*/
+void gridRowSetRender(struct gridRow *row, struct renderCache *render, int colOff, int columns){
+  int span = 0, n = 0, column = 0;
+  enum editorHighlight last = HL_NORMAL;
+  uint16_t attr = 0;
+  size_t pos = 0, j, next;
+  int width;
+  while (column < colOff + columns && renderNextCluster(render, &pos, &j, &next, &width)) {
+    if (width == 0 || column + width <= colOff) {
+      column += width;
+      continue;
+    }
+    // Spans are in logical order. Clusters shown in logical order walk over them, a
+    // line shown reordered jumps back and forth, so it looks up each cluster's span.
+    if (render->visual) {
+      span = renderSpanAt(render, j);
+    } else {
+      while (span < render->numSpans && render->spans[span].start + render->spans[span].size <= j) span++;
+    }
+    enum editorHighlight hl = HL_NORMAL;
+    if (span < render->numSpans && render->spans[span].start <= j) hl = render->spans[span].hl;
+    if (hl != last) {
+      last = hl;
+      attr = attrIntern(editorHighlightToColor(hl), 0);
+    }
+    int cut = column < colOff || column + width > colOff + columns;
+    for (int c = 0; c < width; c++) {
+      if (column + c < colOff || column + c >= colOff + columns) continue;
+      struct cell *cell = &row->cells[n++];
+      cell->glyph = cut ? ' ' : c == 0 ? graphemeGlyph(render->chars + j, next - j) : 0;
+      cell->attr = attr;
+      cell->width = cut ? 1 : c == 0 ? width : 0;
+      cell->pad = 0;
+    }
+    column += width;
+  }
+  row->length = n;
+}
+
+/*
+Hashes count cells, eight bytes at a time. Rows are at most a few hundred cells, so
+this costs a fraction of a microsecond and only runs for rows that were laid out.
+*/
+uint64_t cellsHash(const struct cell *cells, int count){
+  const unsigned char *p = (const unsigned char *)cells;
+  size_t size = sizeof(struct cell) * count;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  for (; i < size; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h ^ (h >> 29);
+}
+
+/*
+Fills the layout grid with the text rows of the window. Past the end of the file
+rows show a TILDE ~ sign at the beginning, very close to how vim works. The panel,
+when shown, covers the last rows of the window.
+A text row is only laid out again when its line, the horizontal scroll or the line's
+render text changed; scrolling by one line or typing on one line leaves the other
+rows alone.
+*/
+void editorLayoutRows(){
+  int windowSize = E.screenRows;
+  int panelStart = windowSize - (E.panelRows < windowSize ? E.panelRows : windowSize);
+  // Next row of the JSON view, the view stops being shown at its last row.
+  int jsonLine = E.json.topLine, jsonRow = E.json.topRow, jsonMore = E.index->numLines > 0;
+  struct mergePosition merge = E.merge.top;
+  if (E.minimap.enabled) minimapLayout();
+  for (int i = 0; i < windowSize; i++) {
+    struct gridRow *row = &E.layout.rows[i];
+    int fileRow = i + E.rowOff;
+    struct rowKey key = {ROW_EMPTY, 0, 0, 0, 0};
+    struct renderCache *render = NULL;
+    if (i >= panelStart) {
+      key.kind = ROW_PANEL;
+    } else if (E.merge.enabled) {
+      int f = mergePeek(&merge);
+      if (f != -1) {
+        key = (struct rowKey){ROW_MERGE, f, 0, merge.offsets[f], 0};
+        mergeStep(&merge, 1);
+      }
+    } else if (E.json.enabled) {
+      if (jsonMore) {
+        key = (struct rowKey){ROW_JSON, jsonLine, jsonRow, E.json.stamp, 0};
+        jsonMore = jsonViewStep(&jsonLine, &jsonRow, 1);
+      }
+    } else if (fileRow < E.index->numLines) {
+      render = lineRender(fileRow);
+      key.kind = ROW_TEXT;
+      key.line = fileRow;
+      key.colOff = E.colOff;
+      key.stamp = render->stamp;
+    }
+    if (E.minimap.enabled && key.kind != ROW_PANEL) key.map = minimapRowKey(i);
+    // Panel lines change without anything to compare, they are always laid out.
+    if (key.kind != ROW_PANEL && key.kind == row->key.kind && key.line == row->key.line &&
+        key.colOff == row->key.colOff && key.stamp == row->key.stamp && key.map == row->key.map) continue;
+    row->key = key;
+
+    if (key.kind == ROW_PANEL) {
+      // Panel lines are drawn in inverted colors.
+      size_t length = strlen(E.panel[i - panelStart]);
+      if (length > (size_t)E.screenColumns) length = E.screenColumns;
+      gridRowSetText(row, E.panel[i - panelStart], length, attrIntern(39, 1));
+    } else if (key.kind == ROW_TEXT) {
+      // Show the part of the line that is scrolled into view.
+      gridRowSetRender(row, render, E.colOff - render->sliceStart, E.textColumns);
+    } else if (key.kind == ROW_JSON) {
+      gridRowSetJson(row, key.line, &jsonRows(key.line)->rows[key.colOff]);
+    } else if (key.kind == ROW_MERGE) {
+      gridRowSetMerge(row, key.line, key.stamp);
+    } else {
+      gridRowSetText(row, "~", 1, 0);
+    }
+    if (key.map) gridRowSetMap(row, key.map);
+    row->hash = cellsHash(row->cells, row->length);
+  }
+}
+
+// Lays out the message bar in the last row of the screen.
+void editorLayoutMessageBar(){
+  struct gridRow *row = &E.layout.rows[E.screenRows];
+  size_t length = strlen(E.statusMessage);
+  if (length > (size_t)E.screenColumns) length = E.screenColumns;
+  if (time(NULL) - E.statusMessageTime >= STATUS_MESSAGE_SECONDS) length = 0;
+  row->key.kind = ROW_MESSAGE;
+  gridRowSetText(row, E.statusMessage, length, 0);
+  row->hash = cellsHash(row->cells, row->length);
+}
+
+/*** paint ***/
+
+int cellEqual(const struct cell *a, const struct cell *b){
+  return memcmp(a, b, sizeof(struct cell)) == 0;
+}
+
+/*
+Returns the index of the first of count cells that differs between a and b, or count
+when they are all the same. With SSE2 a whole 16 bytes of cells are compared at once,
+and the mask of equal bytes gives the first different one.
+*/
+int cellsFirstDiff(const struct cell *a, const struct cell *b, int count){
+  int i = 0;
+#ifdef __SSE2__
+  const int step = 16 / sizeof(struct cell);
+  for (; i + step <= count; i += step) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (equal != 0xffff) return i + __builtin_ctz(~equal) / sizeof(struct cell);
+  }
+#endif
+  while (i < count && cellEqual(&a[i], &b[i])) i++;
+  return i;
+}
+
+// Returns one past the last cell in [from, count) that differs between a and b, or
+// from when they are all the same. Compares backwards from the end like cellsFirstDiff().
+int cellsLastDiff(const struct cell *a, const struct cell *b, int from, int count){
+  int i = count;
+#ifdef __SSE2__
+  const int step = 16 / sizeof(struct cell);
+  for (; i - step >= from; i -= step) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i - step));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i - step));
+    int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (equal != 0xffff) return i - step + (31 - __builtin_clz(~equal & 0xffff)) / sizeof(struct cell) + 1;
+  }
+#endif
+  while (i > from && cellEqual(&a[i - 1], &b[i - 1])) i--;
+  return i;
+}
+
+/*
+Appends the escape sequences that bring the terminal from showing shown to showing
+next, and updates shown to match. Only the changed span of each row is written:
+the cursor is moved to its first changed cell, colors are switched where the
+attributes change, and a shorter row is cleared to its end with K (erase in line).
+Only reads the two grids, so it can be run and timed on its own.
+*/
+void paintGrid(struct grid *next, struct grid *shown, struct abuf *ab){
+  if (!shown->valid) {
+    // Nothing is known about the terminal, start from a clear screen.
+    abAppend(ab, "\x1b[2J", 4);
+    for (int r = 0; r < shown->numRows; r++) {
+      shown->rows[r].length = 0;
+      shown->rows[r].hash = cellsHash(NULL, 0);
+    }
+    shown->valid = 1;
+  }
+  char buf[32];
+  for (int r = 0; r < next->numRows; r++) {
+    struct gridRow *n = &next->rows[r], *s = &shown->rows[r];
+    if (n->hash == s->hash && n->length == s->length) continue;
+    int first = cellsFirstDiff(n->cells, s->cells, n->length < s->length ? n->length : s->length);
+    if (first == n->length && first == s->length) continue;
+    int end = n->length;
+    if (n->length == s->length) end = cellsLastDiff(n->cells, s->cells, first, end);
+    // Wide glyphs are written whole, from their first column.
+    while (first > 0 && ((first < n->length && n->cells[first].width == 0) ||
+                         (first < s->length && s->cells[first].width == 0))) {
+      first--;
+    }
+    while (end < n->length && n->cells[end].width == 0) end++;
+
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", r + 1, first + 1);
+    abAppend(ab, buf, len);
+    uint16_t attr = 0;
+    for (int c = first; c < end; c++) {
+      struct cell *cell = &n->cells[c];
+      if (cell->attr != attr) {
+        attr = cell->attr;
+        abAppend(ab, E.attrs.attrs[attr].sgr, E.attrs.attrs[attr].sgrLen);
+      }
+      if (cell->width == 0) continue;
+      if (cell->glyph & CELL_GRAPHEME) {
+        struct graphemeEntry *entry = &E.graphemes.entries[cell->glyph & ~CELL_GRAPHEME];
+        abAppend(ab, entry->bytes, entry->size);
+      } else {
+        len = utf8Encode(cell->glyph, buf);
+        abAppend(ab, buf, len);
+      }
+    }
+    // Back to default colors, so the erase below does not fill with them.
+    if (attr != 0) abAppend(ab, "\x1b[m", 3);
+    if (n->length < s->length) abAppend(ab, "\x1b[K", 3);
+
+    memcpy(s->cells, n->cells, sizeof(struct cell) * n->length);
+    s->length = n->length;
+    s->hash = n->hash;
+  }
+}
+
+/*** output ***/
+
+// Sets the message shown in the message bar, printf style.
+void editorSetStatusMessage(const char *fmt, ...){
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusMessage, sizeof(E.statusMessage), fmt, ap);
+  va_end(ap);
+  E.statusMessageTime = time(NULL);
+}
+
+// Adds a line to the information panel, printf style. Lines past PANEL_ROWS are dropped.
+void editorPanelAdd(const char *fmt, ...){
+  if (E.panelRows == PANEL_ROWS) return;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.panel[E.panelRows++], PANEL_COLUMNS, fmt, ap);
+  va_end(ap);
+}
+
+// Converts the cursor index into the line text to a screen column. Long lines walk
+// from the nearest column checkpoint.
+int editorLineCxToRx(int at, int cx){
+  struct renderCache *render = lineRender(at);
+  struct lineText text;
+  lineGetText(at, &text);
+  struct textWalk w = {0, 0, 0};
+  if (render->columns) w = columnIndexSeek(render->columns, &text, cx, INT_MAX);
+  textWalkTo(&w, &text, cx);
+  return w.column;
+}
+
+/*
+Adjusts the row and column offsets so the cursor is always inside the visible window.
+*/
+void editorScroll(){
+  E.rx = E.cy < E.index->numLines ? editorLineCxToRx(E.cy, E.cx) : 0;
+  // Lines with right-to-left text show the cursor where its character is displayed.
+  if (E.cy < E.index->numLines) E.rx = lineVisualColumn(E.cy, E.rx);
+  if (E.cy < E.rowOff) E.rowOff = E.cy;
+  if (E.cy >= E.rowOff + E.screenRows) E.rowOff = E.cy - E.screenRows + 1;
+  if (E.rx < E.colOff) E.colOff = E.rx;
+  if (E.rx >= E.colOff + E.textColumns) E.colOff = E.rx - E.textColumns + 1;
+}
+
+/*
+Redraws the screen in two stages: layout computes the cells of the new frame, paint
+sends the terminal what changed since the last one. Everything goes out in a single
+write(), with the cursor hidden meanwhile so it does not flicker across the screen.
+  \x1b : Escape character.
+  [ : Used after the escape character to specify the command to be executed.
+  ?25l / ?25h : Hide and show the cursor.
+  H : Positions the cursor on the screen; takes two parameters that are X and Y separated by ; like <esc>[12;40H
+*/
+void editorRefreshScreen(){
+  if (E.merge.enabled) mergeViewScroll();
+  else if (E.json.enabled) jsonViewScroll();
+  else editorScroll();
+  // Matches dropped for the memory budget are found again once they scroll near.
+  searchReload();
+  editorLayoutRows();
+  editorLayoutMessageBar();
+
+  struct abuf ab = ABUF_INIT;
+  abAppend(&ab, "\x1b[?25l", 6);
+  paintGrid(&E.layout, &E.shown, &ab);
+  // Moves the cursor to its position in the window. Terminal positions are 1 based.
+  char buf[32];
+  int len;
+  if (E.merge.enabled) {
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.merge.cursorScreenRow + 1);
+  } else if (E.json.enabled) {
+    int depth = E.index->numLines ? jsonRows(E.json.cursorLine)->rows[E.json.cursorRow].depth : 0;
+    int column = depth * JSON_INDENT < E.textColumns ? depth * JSON_INDENT : E.textColumns - 1;
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.json.cursorScreenRow + 1, column + 1);
+  } else {
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOff) + 1, (E.rx - E.colOff) + 1);
+  }
+  abAppend(&ab, buf, len);
+  abAppend(&ab, "\x1b[?25h", 6);
+  write(STDOUT_FILENO, ab.b, ab.len);
+  abFree(&ab);
+}
+
+/*** input ***/
+
+/*
+Moves the cursor one step in the direction of the arrow key.
+The cursor can go one past the end of a line and one line past the end of the file,
+which is where text gets appended.
+*/
+void editorMoveCursor(int key){
+  int lineLength = E.cy < E.index->numLines ? (int)lineSize(E.cy) : 0;
+  switch (key) {
+    case ARROW_LEFT:
+      if (E.cx > 0) {
+        E.cx = linePrevCluster(E.cy, E.cx);
+      } else if (E.cy > 0) {
+        // Wrap to the end of the previous line.
+        E.cy--;
+        E.cx = lineSize(E.cy);
+      }
+      break;
+    case ARROW_RIGHT:
+      if (E.cx < lineLength) {
+        E.cx = lineNextCluster(E.cy, E.cx);
+      } else if (E.cy < E.index->numLines) {
+        // Wrap to the start of the next line.
+        E.cy++;
+        E.cx = 0;
+      }
+      break;
+    case ARROW_UP:
+      if (E.cy > 0) E.cy--;
+      break;
+    case ARROW_DOWN:
+      if (E.cy < E.index->numLines) E.cy++;
+      break;
+  }
+
+  // Moving vertically can land past the end of a shorter line, or inside a cluster.
+  lineLength = E.cy < E.index->numLines ? (int)lineSize(E.cy) : 0;
+  if (E.cx > lineLength) E.cx = lineLength;
+  if (E.cx < lineLength) E.cx = lineClusterStart(E.cy, E.cx);
+}
+
+/*
+Shows a prompt in the message bar and returns what the user typed, or NULL when
+the prompt was cancelled with Escape. The prompt is a printf format with one %s
+for the text typed so far. The caller frees the returned string with memFree() as
+MEM_PROMPT memory, its size is its length plus one.
+When callback is not NULL it is called after every key with the text and the key.
+*/
+char *editorPrompt(const char *prompt, void (*callback)(char *, int)){
+  size_t bufsize = 128;
+  char *buf = memAlloc(MEM_PROMPT, bufsize);
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      if (buflen != 0) buf[--buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      if (callback) callback(buf, c);
+      memFree(MEM_PROMPT, buf, bufsize);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0) {
+        editorSetStatusMessage("");
+        if (callback) callback(buf, c);
+        return memRealloc(MEM_PROMPT, buf, bufsize, buflen + 1);
+      }
+    } else if (c < 128 && !iscntrl(c)) {
+      if (buflen == bufsize - 1) {
+        buf = memRealloc(MEM_PROMPT, buf, bufsize, bufsize * 2);
+        bufsize *= 2;
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+    if (callback) callback(buf, c);
+  }
+}
+
+/*** find ***/
+
+// Cursor position when the search prompt opened, restored when it is cancelled.
+struct findState {
+  int cx, cy, rowOff, colOff;
+  // Set until the cursor was moved to a match of the current pattern.
+  int jumpPending;
+} findState;
+
+// Moves the cursor to the first match after (or before) a position, wrapping around
+// the end (or start) of the file.
+int editorFindJump(int line, int col, int direction){
+  struct searchMatch match;
+  if (!searchFindNext(line, col, direction, &match) &&
+      !searchFindNext(direction > 0 ? -1 : E.index->numLines, 0, direction, &match)) {
+    return 0;
+  }
+  E.cy = match.line;
+  E.cx = match.col;
+  return 1;
+}
+
+/*
+Called by the prompt after every key while searching. Typing restarts the search
+with the new pattern, which cancels the tasks still working on the old one.
+Results come in as the chunk tasks finish; the cursor moves to the first match after
+where the search started once one is found. Arrow keys move between matches.
+*/
+void editorFindCallback(char *query, int key){
+  if (key == '\x1b') {
+    editorSearchStop();
+    E.cx = findState.cx;
+    E.cy = findState.cy;
+    E.rowOff = findState.rowOff;
+    E.colOff = findState.colOff;
+    return;
+  }
+  if (key == '\r') return;
+
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    editorFindJump(E.cy, E.cx, 1);
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    editorFindJump(E.cy, E.cx, -1);
+  } else if (key == TASK_DONE) {
+    if (findState.jumpPending && editorFindJump(findState.cy, findState.cx - 1, 1)) {
+      findState.jumpPending = 0;
+    }
+  } else if (query[0] == '\0') {
+    editorSearchStop();
+  } else if (E.search == NULL || strcmp(query, E.search->pattern) != 0) {
+    editorSearchStart(query);
+    findState.jumpPending = !editorFindJump(findState.cy, findState.cx - 1, 1);
+  }
+}
+
+// Incremental search. Matches stay highlighted after Enter, until the next search.
+void editorFind(){
+  findState.cx = E.cx;
+  findState.cy = E.cy;
+  findState.rowOff = E.rowOff;
+  findState.colOff = E.colOff;
+  findState.jumpPending = 0;
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  // A search that moved the cursor is a jump, Ctrl-O goes back to where it started.
+  if (query == NULL) return;
+  if (E.cy != findState.cy || E.cx != findState.cx) jumpPush(findState.cy, findState.cx);
+  memFree(MEM_PROMPT, query, strlen(query) + 1);
+}
+
+/*** commands ***/
+
+// Shows how much memory each subsystem uses in the panel.
+void editorMemStats(){
+  char used[32], budget[32];
+  E.panelRows = 0;
+  editorPanelAdd("memory usage");
+  for (int i = 0; i < MEM_CATEGORIES; i++) {
+    memFormat(used, sizeof(used), __atomic_load_n(&E.memUsed[i], __ATOMIC_RELAXED));
+    editorPanelAdd("  %-14s %12s", memCategoryNames[i], used);
+  }
+  memFormat(used, sizeof(used), memTotal());
+  editorPanelAdd("  %-14s %12s", "total", used);
+  memFormat(used, sizeof(used), __atomic_load_n(&E.memPeak, __ATOMIC_RELAXED));
+  editorPanelAdd("  %-14s %12s", "peak", used);
+  if (E.memBudget) {
+    memFormat(budget, sizeof(budget), E.memBudget);
+    editorPanelAdd("  %-14s %12s", "budget", budget);
+  } else {
+    editorPanelAdd("  %-14s %12s", "budget", "none");
+  }
+}
+
+// Microseconds taken by frames paints of the current layout, over a blank screen or
+// over the same frame when unchanged is set. The output is thrown away.
+double editorPaintTime(struct grid *shown, int frames, int unchanged, size_t *bytes){
+  struct timespec start, end;
+  *bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < frames; i++) {
+    struct abuf ab = ABUF_INIT;
+    if (!unchanged) shown->valid = 0;
+    paintGrid(&E.layout, shown, &ab);
+    *bytes += ab.len;
+    abFree(&ab);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+/*
+Times the paint stage on its own: painting the current layout over a blank screen,
+and finding that nothing changed when it is painted again.
+*/
+void editorPaintBench(int frames){
+  struct grid shown;
+  gridAlloc(&shown, E.layout.numRows, E.layout.numColumns);
+  size_t bytes, none;
+  double full = editorPaintTime(&shown, frames, 0, &bytes);
+  double same = editorPaintTime(&shown, frames, 1, &none);
+  gridFree(&shown);
+  editorSetStatusMessage("paint: %.1f us per frame, %zu bytes; unchanged: %.2f us",
+                         full / frames, bytes / frames, same / frames);
+}
+
+/*
+Shows or hides the minimap. The text is narrowed to make room for it, so the
+horizontal scroll is brought back to the cursor.
+*/
+void minimapToggle(){
+  struct minimap *m = &E.minimap;
+  if (E.screenColumns <= MINIMAP_COLUMNS) return;
+  m->enabled = !m->enabled;
+  E.textColumns = m->enabled ? E.screenColumns - MINIMAP_COLUMNS : E.screenColumns;
+  if (m->enabled && m->rowMatches == NULL) {
+    m->rowMatches = memCalloc(MEM_MINIMAP, E.screenRows, sizeof(long));
+    m->rowEdits = memCalloc(MEM_MINIMAP, E.screenRows, sizeof(long));
+  }
+  editorSetStatusMessage(m->enabled ? "Minimap: matches, then edits" : "Minimap hidden");
+}
+
+/*
+Switches the JSON view on or off. The view opens on the row holding the cursor, and
+closing it puts the cursor at the start of the row it was on in the view.
+*/
+void jsonViewToggle(){
+  struct jsonView *v = &E.json;
+  if (v->enabled) {
+    v->enabled = 0;
+    E.cy = v->cursorLine;
+    E.cx = jsonRows(v->cursorLine)->rows[v->cursorRow].start;
+    return;
+  }
+  if (E.index->numLines == 0) {
+    editorSetStatusMessage("Nothing to view");
+    return;
+  }
+  jsonViewClear();
+  E.merge.enabled = 0;
+  v->enabled = 1;
+  v->cursorLine = E.cy < E.index->numLines ? E.cy : E.index->numLines - 1;
+  struct jsonLayout *layout = jsonRows(v->cursorLine);
+  v->cursorRow = 0;
+  while (v->cursorRow + 1 < layout->numRows && layout->rows[v->cursorRow + 1].start <= (size_t)E.cx) v->cursorRow++;
+  v->topLine = E.rowOff <= v->cursorLine ? E.rowOff : v->cursorLine;
+  v->topRow = 0;
+  editorSetStatusMessage("JSON view, read only. Ctrl-P json to leave it");
+}
+
+/*
+Handles a key while a read only view, like the JSON or merge view, is shown. The
+up and down keys move the view's cursor by a row and the page keys by a screen, with
+move; keys that would edit are refused. Returns 0 for the keys the view leaves to
+the editor.
+*/
+int viewProcessKey(int c, const char *name, void (*move)(int delta)){
+  switch (c) {
+    case TASK_DONE:
+    case CTRL_KEY('q'):
+    case CTRL_KEY('p'):
+      return 0;
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case PAGE_UP:
+    case PAGE_DOWN:
+      move(c == ARROW_UP ? -1 : c == ARROW_DOWN ? 1 : c == PAGE_UP ? -E.screenRows : E.screenRows);
+      return 1;
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+    case HOME_KEY:
+    case END_KEY:
+      return 1;
+    default:
+      editorSetStatusMessage("%s view is read only", name);
+      return 1;
+  }
+}
+
+// Moves the cursor of the JSON view by delta rows and shows where its row is in the file.
+void jsonViewMove(int delta){
+  struct jsonView *v = &E.json;
+  jsonViewStep(&v->cursorLine, &v->cursorRow, delta);
+  struct jsonRow *row = &jsonRows(v->cursorLine)->rows[v->cursorRow];
+  editorSetStatusMessage("line %d, bytes %zu-%zu", v->cursorLine + 1, row->start, row->end);
+}
+
+/*
+Moves the cursor of the merge view to the first entry logged at or after a time, on
+the day of the cursor row or as a full date and time like the time command takes.
+The files all have timestamps of the same format, so the day of one is the day of
+all. Every file is searched on its own, and the positions found together are that
+point of the merge.
+*/
+void mergeJumpToTime(const char *arg){
+  struct mergeView *v = &E.merge;
+  int f = mergePeek(&v->cursor);
+  if (f == -1) f = mergePeek(&v->top);
+  long long here = f == -1 ? LLONG_MIN : v->cursor.keys[f];
+  long long time = timeArgument(arg, v->sources[0].format, here == LLONG_MIN ? -1 : here);
+  if (time < 0) {
+    editorSetStatusMessage("Usage: time HH:MM:SS");
+    return;
+  }
+  for (int i = 0; i < v->numSources; i++) mergeSeek(&v->cursor, i, mergeFindTime(&v->sources[i], time));
+  v->top = v->cursor;
+  f = mergePeek(&v->cursor);
+  if (f == -1) editorSetStatusMessage("Nothing logged at or after %s", arg);
+  else editorSetStatusMessage("%s, byte %zu", v->sources[f].name, v->cursor.offsets[f]);
+}
+
+/*
+Switches the merge view of the files given on the command line on or off. The files
+are mapped the first time, the view starts at the beginning of all of them.
+Timestamps of different formats do not sort together, so files without timestamps
+or with timestamps unlike those of the first file are left out, with a warning.
+*/
+void mergeViewToggle(){
+  struct mergeView *v = &E.merge;
+  if (v->enabled) {
+    v->enabled = 0;
+    return;
+  }
+  const char *leftOut = NULL;
+  if (v->numSources == 0) {
+    if (E.numFiles < 2) {
+      editorSetStatusMessage("Give several files on the command line to merge them");
+      return;
+    }
+    for (int i = 0; i < E.numFiles && v->numSources < MERGE_MAX_FILES; i++) {
+      struct mergeSource *src = &v->sources[v->numSources];
+      if (!mergeOpen(src, E.fileNames[i])) {
+        editorSetStatusMessage("Cannot read %s", E.fileNames[i]);
+        continue;
+      }
+      if (src->format == TIME_NONE || (v->numSources > 0 && src->format != v->sources[0].format)) {
+        leftOut = src->name;
+        mergeClose(src);
+        continue;
+      }
+      v->numSources++;
+    }
+    if (v->numSources < 2) {
+      for (int f = 0; f < v->numSources; f++) mergeClose(&v->sources[f]);
+      v->numSources = 0;
+      if (leftOut) editorSetStatusMessage("Nothing to merge, %s has no timestamps like the other files", leftOut);
+      return;
+    }
+    for (int f = 0; f < v->numSources; f++) mergeSeek(&v->top, f, 0);
+    v->cursor = v->top;
+  }
+  E.json.enabled = 0;
+  v->enabled = 1;
+  if (leftOut) {
+    editorSetStatusMessage("Merge of %d files, %s left out: no timestamps like the other files",
+                           v->numSources, leftOut);
+  } else {
+    editorSetStatusMessage("Merge of %d files, read only. Ctrl-P merge to leave it", v->numSources);
+  }
+}
+
+// Moves the cursor of the merge view by delta rows and shows which file and byte its
+// row is.
+void mergeViewMove(int delta){
+  struct mergeView *v = &E.merge;
+  struct mergePosition p = v->cursor;
+  mergeStep(&p, delta);
+  // The position after the last row has no row, stay on the last one.
+  if (mergePeek(&p) != -1) v->cursor = p;
+  int f = mergePeek(&v->cursor);
+  if (f != -1) editorSetStatusMessage("%s, byte %zu", v->sources[f].name, v->cursor.offsets[f]);
+}
+
+/*
+Moves the cursor to the first line logged at or after a time, given as HH:MM:SS on
+the day of the cursor line, or as a full YYYY-MM-DD HH:MM:SS for ISO timestamps.
+*/
+void editorJumpToTime(const char *arg){
+  if (E.merge.enabled) {
+    mergeJumpToTime(arg);
+    return;
+  }
+  timeIndexUpdate();
+  if (E.times.format == TIME_NONE) {
+    editorSetStatusMessage("No timestamps found at the start of lines");
+    return;
+  }
+  // Same day as the cursor line, or as the entry it belongs to.
+  long long here = timeLine(E.cy < E.index->numLines ? E.cy : 0);
+  long long time = timeArgument(arg, E.times.format, here);
+  if (time < 0) {
+    editorSetStatusMessage("Usage: time HH:MM:SS");
+    return;
+  }
+  int at = timeFind(time);
+  if (at == E.index->numLines) {
+    editorSetStatusMessage("Nothing logged at or after %s", arg);
+    return;
+  }
+  jumpPush(E.cy, E.cx);
+  E.cy = at;
+  E.cx = 0;
+  // Show the line at the top of the window, with what was logged after it below.
+  E.rowOff = at;
+  editorSetStatusMessage("Line %d", at + 1);
+}
+
+/*
+Runs a command typed at the command prompt.
+  memstats          : Shows memory used per subsystem.
+  membudget <MB>    : Sets the memory budget in megabytes, 0 removes it.
+  json              : Shows or hides the JSON view.
+  merge             : Shows or hides the merge of the files on the command line.
+  minimap           : Shows or hides the density of matches and edits at the right edge.
+  mark <name>       : Sets a mark called name at the cursor.
+  unmark <name>     : Removes a mark.
+  goto <name>       : Moves the cursor to a mark.
+  marks             : Lists the marks.
+  stats [field]     : Shows line counts per log level, or per value of a field.
+  stats off         : Stops keeping the counts up to date.
+  time <time>       : Jumps to the first line logged at or after a time.
+  paintbench [N]    : Times painting the screen, over N frames (1000 by default).
+*/
+void editorRunCommand(const char *command){
+  if (strcmp(command, "memstats") == 0) {
+    editorMemStats();
+  } else if (strncmp(command, "membudget ", 10) == 0) {
+    E.memBudget = strtoull(command + 10, NULL, 10) * 1024 * 1024;
+    editorEnforceBudget();
+    editorSetStatusMessage(E.memBudget ? "Memory budget set to %s MB" : "Memory budget removed", command + 10);
+  } else if (strncmp(command, "time ", 5) == 0) {
+    editorJumpToTime(command + 5);
+  } else if (strcmp(command, "stats off") == 0) {
+    statsStop();
+  } else if (strcmp(command, "stats") == 0 || strncmp(command, "stats ", 6) == 0) {
+    // The field name without the spaces around it; a blank one counts log levels.
+    char name[PANEL_COLUMNS];
+    const char *start = command + 5;
+    while (*start == ' ') start++;
+    int length = strlen(start);
+    while (length > 0 && start[length - 1] == ' ') length--;
+    snprintf(name, sizeof(name), "%.*s", length, start);
+    const char *field = name[0] ? name : NULL;
+    // The same counts again are already kept up to date.
+    if (E.stats && (field ? E.stats->field && strcmp(field, E.stats->field) == 0 : E.stats->field == NULL)) {
+      E.stats->show = 1;
+    } else {
+      statsStart(field);
+    }
+  } else if (strcmp(command, "merge") == 0) {
+    mergeViewToggle();
+  } else if (strncmp(command, "mark ", 5) == 0) {
+    markSet(command + 5);
+  } else if (strncmp(command, "unmark ", 7) == 0) {
+    markUnset(command + 7);
+  } else if (strncmp(command, "goto ", 5) == 0) {
+    markGoto(command + 5);
+  } else if (strcmp(command, "marks") == 0) {
+    markList();
+  } else if (strcmp(command, "minimap") == 0) {
+    minimapToggle();
+  } else if (strcmp(command, "json") == 0) {
+    jsonViewToggle();
+  } else if (strncmp(command, "paintbench", 10) == 0) {
+    int frames = atoi(command + 10);
+    editorPaintBench(frames > 0 ? frames : 1000);
+  } else {
+    editorSetStatusMessage("Unknown command: %s", command);
+  }
+}
+
+/*
+Reads the key from the terminal and acts on it.
+Ctrl Q exits the program, navigation keys move the cursor and printable keys are inserted.
+*/
+void editorProcessKey(){
+  int c = editorReadKey();
+  // The panel is only shown until the next key press.
+  if (c != TASK_DONE) E.panelRows = 0;
+  if (E.merge.enabled && viewProcessKey(c, "Merge", mergeViewMove)) return;
+  if (E.json.enabled && viewProcessKey(c, "JSON", jsonViewMove)) return;
+  switch (c){
+    case TASK_DONE:
+      // Background work finished, the caller redraws the screen.
+      break;
+
+    case CTRL_KEY('q'):
+      sessionSave();
       // Clears out the screen.
       write(STDOUT_FILENO, "\x1b[2J", 4);
       // Repositions the cursor at start of screen.
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
       break;
+
+    case CTRL_KEY('p'):
+      {
+        // Command prompt, like : in vim.
+        char *command = editorPrompt(":%s", NULL);
+        if (command) {
+          editorRunCommand(command);
+          memFree(MEM_PROMPT, command, strlen(command) + 1);
+        }
+      }
+      break;
+
+    case CTRL_KEY('f'):
+      editorFind();
+      break;
+
+    case CTRL_KEY('o'):
+      jumpBack();
+      break;
+    case CTRL_KEY('n'):
+      jumpForward();
+      break;
+
+    case HOME_KEY:
+      E.cx = 0;
+      break;
+    case END_KEY:
+      if (E.cy < E.index->numLines) E.cx = lineSize(E.cy);
+      break;
+
+    case PAGE_UP:
+    case PAGE_DOWN:
+      {
+        // Move to the edge of the window, then a whole screen further.
+        if (c == PAGE_UP) {
+          E.cy = E.rowOff;
+        } else {
+          E.cy = E.rowOff + E.screenRows - 1;
+          if (E.cy > E.index->numLines) E.cy = E.index->numLines;
+        }
+        int times = E.screenRows;
+        while (times--) editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+      }
+      break;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+      editorMoveCursor(c);
+      break;
+
+    case '\r':
+      editorInsertNewline();
+      break;
+
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+      editorDelChar();
+      break;
+    case DEL_KEY:
+      // Deleting forward is deleting backward from one position further.
+      if (E.cy < E.index->numLines && E.cx < (int)lineSize(E.cy)) {
+        E.cx = lineNextCluster(E.cy, E.cx);
+        editorDelChar();
+      } else if (E.cy + 1 < E.index->numLines) {
+        E.cy++;
+        E.cx = 0;
+        editorDelChar();
+      }
+      break;
+
+    default:
+      if (!iscntrl(c) || c == '\t') editorInsertChar(c);
+      break;
+  }
+
+  // Edits to the active line are kept in the gap buffer until the cursor moves away.
+  if (E.active.line != -1 && E.active.line != E.cy) {
+    editorFlushActiveLine();
+  }
+}
+
+/*** session ***/
+
+// Returns the path of the session file.
+const char *sessionPath(){
+  const char *path = getenv("SOCKS_SESSION");
+  return path && *path ? path : SESSION_FILE;
+}
+
+/*
+Writes the files, cursor, window, marks, jump list and search of the editor to the
+session file. The file is written next to it and renamed over it, so a crash never
+leaves half a session. Nothing is saved when no file is open, which keeps the last
+session for the next start without arguments.
+*/
+void sessionSave(){
+  if (E.numFiles == 0) return;
+  struct abuf ab = ABUF_INIT;
+  struct markTree *t = &E.marks;
+  struct sessionHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+  header.numFiles = E.numFiles;
+  header.cx = E.cx;
+  header.cy = E.cy;
+  header.rowOff = E.rowOff;
+  header.colOff = E.colOff;
+  header.minimap = E.minimap.enabled;
+  for (int n = 1; n < t->capacity; n++) header.numMarks += t->nodes[n].priority && t->nodes[n].name[0];
+  header.numJumps = E.jumps.count;
+  header.jumpCurrent = E.jumps.current;
+  header.patternSize = E.search ? E.search->patternLen : 0;
+  abAppend(&ab, (const char *)&header, sizeof(header));
+
+  for (int i = 0; i < E.numFiles; i++) {
+    struct sessionFile file;
+    struct stat st;
+    memset(&file, 0, sizeof(file));
+    if (stat(E.fileNames[i], &st) == 0) {
+      file.size = st.st_size;
+      file.mtime = st.st_mtime;
+      file.inode = st.st_ino;
+    }
+    file.numLines = i == 0 ? E.index->numLines : 0;
+    file.modified = i == 0 && E.version != 0;
+    file.nameSize = strlen(E.fileNames[i]);
+    abAppend(&ab, (const char *)&file, sizeof(file));
+    abAppend(&ab, E.fileNames[i], file.nameSize);
+  }
+  for (int n = 1; n < t->capacity; n++) {
+    if (!t->nodes[n].priority || !t->nodes[n].name[0]) continue;
+    struct sessionMark mark;
+    mark.pos = markPosition(n);
+    memcpy(mark.name, t->nodes[n].name, MARK_NAME_SIZE);
+    abAppend(&ab, (const char *)&mark, sizeof(mark));
+  }
+  for (int i = 0; i < E.jumps.count; i++) {
+    int64_t pos = markPosition(E.jumps.anchors[i]);
+    abAppend(&ab, (const char *)&pos, sizeof(pos));
+  }
+  if (E.search) abAppend(&ab, E.search->pattern, E.search->patternLen);
+
+  // Failing to save the session is not worth losing the exit over.
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", sessionPath());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1) {
+    int written = 0;
+    while (written < ab.len) {
+      ssize_t n = write(fd, ab.b + written, ab.len - written);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      written += n;
+    }
+    close(fd);
+    if (written == ab.len) rename(tmp, sessionPath());
+    else unlink(tmp);
+  }
+  abFree(&ab);
+}
+
+// Bounds checked reads from a mapped session file.
+struct sessionReader {
+  const char *data;
+  size_t size;
+  size_t pos;
+};
+
+// Points *at at the next size bytes and skips them. Returns 0 when the file is too short.
+int sessionTake(struct sessionReader *r, size_t size, const char **at){
+  if (size > r->size - r->pos) return 0;
+  *at = r->data + r->pos;
+  r->pos += size;
+  return 1;
+}
+
+// Copies the next size bytes to dst. Returns 0 when the file is too short.
+int sessionRead(struct sessionReader *r, void *dst, size_t size){
+  const char *at;
+  if (!sessionTake(r, size, &at)) return 0;
+  memcpy(dst, at, size);
+  return 1;
+}
+
+// Frees count file names read from a session.
+void sessionFreeNames(char **names, int count){
+  for (int i = 0; i < count; i++) {
+    if (names[i]) memFree(MEM_MARKS, names[i], strlen(names[i]) + 1);
+  }
+  memFree(MEM_MARKS, names, sizeof(char *) * count);
+}
+
+/*
+Reads the files of a session. Returns their names, or NULL when the session is not
+for the files given on the command line or a file is gone. Sets *changed when a file
+is not the size, age or inode it was when the session was saved, and copies the
+entry of the first file, the one that was open, to *first.
+*/
+char **sessionReadFiles(struct sessionReader *r, int numFiles, int *changed, struct sessionFile *first){
+  char **names = memCalloc(MEM_MARKS, numFiles, sizeof(char *));
+  for (int i = 0; i < numFiles; i++) {
+    struct sessionFile file;
+    struct stat st;
+    const char *name;
+    if (!sessionRead(r, &file, sizeof(file)) || !sessionTake(r, file.nameSize, &name) ||
+        memchr(name, '\0', file.nameSize)) {
+      break;
+    }
+    if (i == 0) *first = file;
+    names[i] = memAlloc(MEM_MARKS, (size_t)file.nameSize + 1);
+    memcpy(names[i], name, file.nameSize);
+    names[i][file.nameSize] = '\0';
+    if ((E.numFiles && strcmp(names[i], E.fileNames[i]) != 0) || stat(names[i], &st) == -1) break;
+    *changed |= (uint64_t)st.st_size != file.size || st.st_mtime != file.mtime || (uint64_t)st.st_ino != file.inode;
+    if (i == numFiles - 1) return names;
+  }
+  sessionFreeNames(names, numFiles);
+  return NULL;
+}
+
+/*
+Opens the files of a session and puts back its state. Returns 0 when the session
+does not apply, leaving the editor as it was.
+*/
+int sessionApply(struct sessionReader *r){
+  struct sessionHeader header;
+  int changed = 0;
+  if (!sessionRead(r, &header, sizeof(header)) || memcmp(header.magic, SESSION_MAGIC, sizeof(header.magic)) != 0 ||
+      header.numFiles <= 0 || (size_t)header.numFiles > r->size / sizeof(struct sessionFile) || header.numJumps < 0 || header.numJumps > JUMP_LIST_SIZE) {
+    return 0;
+  }
+  if (E.numFiles != 0 && E.numFiles != header.numFiles) return 0;
+  struct sessionFile first;
+  char **names = sessionReadFiles(r, header.numFiles, &changed, &first);
+  if (names == NULL) return 0;
+  if (E.numFiles == 0) {
+    E.fileNames = names;
+    E.numFiles = header.numFiles;
+  } else {
+    sessionFreeNames(names, header.numFiles);
+  }
+  editorOpen(E.fileNames[0]);
+  // The positions are in the text as it was, which edits that were not written back
+  // leave different from the file.
+  changed |= first.modified || E.index->numLines != first.numLines;
+
+  for (int i = 0; i < header.numMarks; i++) {
+    struct sessionMark mark;
+    if (!sessionRead(r, &mark, sizeof(mark))) break;
+    mark.name[MARK_NAME_SIZE - 1] = '\0';
+    if (mark.name[0] && markFind(mark.name) == 0) markInsert(markNodeNew(mark.name, mark.pos));
+  }
+  for (int i = 0; i < header.numJumps; i++) {
+    int64_t pos;
+    if (!sessionRead(r, &pos, sizeof(pos))) break;
+    jumpAppend(pos >> 32, pos & 0xffffffff);
+  }
+  E.jumps.current = header.jumpCurrent < 0 ? 0 : header.jumpCurrent > E.jumps.count ? E.jumps.count : header.jumpCurrent;
+  E.marks.seen = E.edits.head;
+
+  editorGotoPosition(markPos(header.cy, header.cx));
+  E.rowOff = header.rowOff < 0 ? 0 : header.rowOff > E.index->numLines ? E.index->numLines : header.rowOff;
+  E.colOff = header.colOff < 0 ? 0 : header.colOff;
+  if (header.minimap && !E.minimap.enabled) minimapToggle();
+  const char *chars;
+  if (header.patternSize > 0 && sessionTake(r, header.patternSize, &chars)) {
+    char *pattern = memAlloc(MEM_SEARCH, header.patternSize + 1);
+    memcpy(pattern, chars, header.patternSize);
+    pattern[header.patternSize] = '\0';
+    editorSearchStart(pattern);
+    memFree(MEM_SEARCH, pattern, header.patternSize + 1);
+  }
+  editorSetStatusMessage(changed ? "Session restored, but the text changed since it was saved" : "Session restored");
+  return 1;
+}
+
+/*
+Restores the session of the last run when it is for the files given on the command
+line, or for any files when none were given. The session file is mapped rather than
+read, and its entries are copied out of the mapping one at a time. Returns 1 when
+the session was restored, with its first file open.
+*/
+int sessionRestore(){
+  int fd = open(sessionPath(), O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 0;
   }
+  const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+  struct sessionReader r = {data, st.st_size, 0};
+  int restored = sessionApply(&r);
+  munmap((void *)data, st.st_size);
+  return restored;
 }
 
 /*** init ***/
@@ -212,19 +6821,52 @@ void init(){
   // Enable the raw mode.
   enableRawMode();
 
+  E.index = lineIndexNew();
+
+  taskPoolInit();
+
+  // No line is being edited yet.
+  E.active.line = -1;
+  for (int i = 0; i < JSON_CACHE_LINES; i++) E.json.cache[i].line = -1;
+
   // Set windows size
   if(getWindowSize(&E.screenRows, &E.screenColumns) == -1){
       die("init - getWindowSize");
   }
+  // Leave the last row for the message bar.
+  E.screenRows -= 1;
+  E.textColumns = E.screenColumns;
+
+  renderClockInit();
+  // The message bar is the row below the text.
+  gridAlloc(&E.layout, E.screenRows + 1, E.screenColumns);
+  // Default colors take index 0 in the attribute table.
+  attrIntern(39, 0);
+  gridAlloc(&E.shown, E.screenRows + 1, E.screenColumns);
+
+  // Memory budget in megabytes, for running on shared machines.
+  char *budget = getenv("SOCKS_MEM_BUDGET");
+  if (budget) E.memBudget = strtoull(budget, NULL, 10) * 1024 * 1024;
 }
 /*
   Entry point of the program.
+  Usage : socks [filename [more files to merge...]]
+  Without files, the files of the last session are opened again.
 */
-int main()
+int main(int argc, char *argv[])
 {
   init();
+  E.fileNames = argv + 1;
+  E.numFiles = argc - 1;
+  editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-F = find | Ctrl-O = back | Ctrl-P = command");
+  // The session of the last run, for these files or for any files when none are given.
+  if (!sessionRestore() && E.numFiles) {
+    editorOpen(E.fileNames[0]);
+  }
   while (1)
   {
+    editorObserveEdits();
+    editorEnforceBudget();
     editorRefreshScreen();
     editorProcessKey();
   }